@@ -0,0 +1,291 @@
+// Decoder throughput and per-stage timings over the synthetic corpus.
+//
+// Usage: bench [corpus_dir]. Without a directory the default corpus is
+// generated in memory, with one the files written by make_corpus are used.
+#include "corpus.h"
+#include "../decoder.h"
+#include "../fft.h"
+#include "../kernels.h"
+#include "../tensor.h"
+#include "../transcode.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+std::atomic<size_t> allocations{0};
+
+struct Sample {
+    std::string name;
+    uint16_t width;
+    uint16_t height;
+    std::string jpeg;
+};
+
+// Seconds per call of |f|, runs it for at least |min_seconds|.
+template <class F>
+double Measure(F f, double min_seconds = 0.3) {
+    using Clock = std::chrono::steady_clock;
+    f();
+    size_t iterations = 0;
+    auto start = Clock::now();
+    std::chrono::duration<double> elapsed{0};
+    do {
+        f();
+        ++iterations;
+        elapsed = Clock::now() - start;
+    } while (elapsed.count() < min_seconds);
+    return elapsed.count() / iterations;
+}
+
+std::vector<Sample> LoadCorpus(const char *dir) {
+    std::vector<Sample> corpus;
+    for (const CorpusSpec &spec : DefaultCorpus()) {
+        Sample sample{CorpusName(spec), spec.width, spec.height, {}};
+        if (dir) {
+            std::ifstream input(std::string(dir) + "/" + sample.name, std::ios::binary);
+            std::stringstream buffer;
+            buffer << input.rdbuf();
+            sample.jpeg = buffer.str();
+        } else {
+            sample.jpeg = GenerateJpeg(spec);
+        }
+        if (sample.jpeg.empty()) {
+            throw std::invalid_argument("Missing corpus file " + sample.name);
+        }
+        corpus.push_back(std::move(sample));
+    }
+    return corpus;
+}
+
+const char *LevelName(CpuLevel level) {
+    switch (level) {
+        case CpuLevel::kScalar:
+            return "scalar";
+        case CpuLevel::kSSE42:
+            return "sse4.2";
+        case CpuLevel::kAVX2:
+            return "avx2";
+        case CpuLevel::kAVX512:
+            return "avx512";
+    }
+    return "unknown";
+}
+
+void BenchDecode(const std::vector<Sample> &corpus) {
+    std::printf("%-28s %10s %10s %14s\n", "decode", "MP/s", "ms", "allocs/decode");
+    for (const Sample &sample : corpus) {
+        double megapixels = sample.width * sample.height / 1e6;
+        double seconds = Measure([&] {
+            std::istringstream input(sample.jpeg);
+            Decode(input);
+        });
+        size_t before = allocations.load();
+        std::istringstream input(sample.jpeg);
+        Decode(input);
+        size_t count = allocations.load() - before;
+        std::printf("%-28s %10.2f %10.3f %14zu\n", sample.name.c_str(), megapixels / seconds,
+                    seconds * 1e3, count);
+    }
+}
+
+// Entropy decoding only, dominated by Huffman decoding of ReadCoefs.
+void BenchHuffman(const std::vector<Sample> &corpus) {
+    std::printf("\n%-28s %10s %10s\n", "huffman", "MP/s", "MB/s");
+    for (const Sample &sample : corpus) {
+        if (sample.width < 640) {
+            continue;
+        }
+        double seconds = Measure([&] {
+            std::istringstream input(sample.jpeg);
+            ReadCoefImage(input);
+        });
+        std::printf("%-28s %10.2f %10.2f\n", sample.name.c_str(),
+                    sample.width * sample.height / 1e6 / seconds,
+                    sample.jpeg.size() / 1e6 / seconds);
+    }
+}
+
+// ReadEntropySegment over the entropy coded data of the largest sample.
+void BenchPrescan(const std::vector<Sample> &corpus) {
+    const std::string &jpeg = corpus.back().jpeg;
+    size_t sos = jpeg.find("\xff\xda");
+    size_t length = static_cast<uint8_t>(jpeg[sos + 2]) << 8 | static_cast<uint8_t>(jpeg[sos + 3]);
+    std::string data = jpeg.substr(sos + 2 + length);
+    std::printf("\n%-28s %10s\n", "prescan", "MB/s");
+    CpuLevel detected = DetectCpuLevel();
+    for (int level = 0; level <= static_cast<int>(detected); ++level) {
+        SetCpuLevel(static_cast<CpuLevel>(level));
+        double seconds = Measure([&] {
+            std::istringstream input(data);
+            ReadEntropySegment(input, data.size());
+        });
+        std::printf("%-28s %10.1f\n", LevelName(static_cast<CpuLevel>(level)),
+                    data.size() / 1e6 / seconds);
+    }
+    SetCpuLevel(detected);
+}
+
+// Normalized NCHW float tensor of the largest sample, through Image and fused.
+void BenchTensor(const std::vector<Sample> &corpus) {
+    const Sample &sample = corpus.back();
+    double megapixels = sample.width * sample.height / 1e6;
+    TensorOptions options;
+    options.scale = {1 / 58.4f, 1 / 57.1f, 1 / 57.4f};
+    options.offset = {-2.12f, -2.04f, -1.80f};
+    std::vector<float> tensor(3 * sample.width * sample.height);
+    std::printf("\n%-28s %10s\n", "tensor", "MP/s");
+    double seconds = Measure([&] {
+        std::istringstream input(sample.jpeg);
+        Image image = Decode(input);
+        size_t plane = image.Width() * image.Height();
+        for (size_t i = 0; i < image.Height(); ++i) {
+            for (size_t j = 0; j < image.Width(); ++j) {
+                RGB pixel = image.GetPixel(i, j);
+                size_t pos = i * image.Width() + j;
+                tensor[pos] = pixel.r * options.scale[0] + options.offset[0];
+                tensor[plane + pos] = pixel.g * options.scale[1] + options.offset[1];
+                tensor[2 * plane + pos] = pixel.b * options.scale[2] + options.offset[2];
+            }
+        }
+    });
+    std::printf("%-28s %10.2f\n", "image+convert", megapixels / seconds);
+    for (size_t scale : {1, 2, 4, 8}) {
+        options.scale_denom = scale;
+        seconds = Measure([&] {
+            std::istringstream input(sample.jpeg);
+            DecodeToTensor(input, tensor.data(), tensor.size() * sizeof(float), options);
+        });
+        std::string name = "fused 1/" + std::to_string(scale);
+        std::printf("%-28s %10.2f\n", name.c_str(), megapixels / seconds);
+    }
+}
+
+void BenchBlocks() {
+    const size_t blocks = 4096;
+    std::vector<uint16_t> qt(64);
+    std::pmr::vector<uint16_t> coefs(64 * blocks);
+    uint32_t state = 1;
+    for (size_t i = 0; i < qt.size(); ++i) {
+        qt[i] = 1 + i;
+    }
+    for (size_t i = 0; i < coefs.size(); ++i) {
+        state = state * 1664525 + 1013904223;
+        // Mostly small values with many zeros, like a real quantized block.
+        coefs[i] = i % 64 < 10 ? static_cast<int16_t>((state >> 24) % 64) - 32 : 0;
+    }
+
+    std::pmr::vector<uint16_t> table(64);
+    std::pmr::vector<double> dequantized(64), dct_input(64), dct_output(64);
+    std::pmr::vector<int16_t> normalized(64);
+    DctCalculator dct(8, &dct_input, &dct_output);
+    std::printf("\n%-28s %10s\n", "stage", "ns/block");
+    double seconds = Measure([&] {
+        for (size_t b = 0; b < blocks; ++b) {
+            std::copy(coefs.begin() + b * 64, coefs.begin() + (b + 1) * 64, table.begin());
+            QTDevide(table, qt, dequantized);
+            DecodeZigZag(dequantized, dct_input);
+        }
+    });
+    std::printf("%-28s %10.1f\n", "dequant+zigzag", seconds / blocks * 1e9);
+    seconds = Measure([&] {
+        for (size_t b = 0; b < blocks; ++b) {
+            std::fill(dct_input.begin(), dct_input.end(), b % 64);
+            dct_input[b % 64] = 100;
+            dct.Inverse();
+        }
+    });
+    std::printf("%-28s %10.1f\n", "idct", seconds / blocks * 1e9);
+    for (size_t i = 0; i < 64; ++i) {
+        dct_output[i] = static_cast<double>(i * 5) - 160;
+    }
+    seconds = Measure([&] {
+        for (size_t b = 0; b < blocks; ++b) {
+            Norm(dct_output, normalized);
+        }
+    });
+    std::printf("%-28s %10.1f\n", "norm", seconds / blocks * 1e9);
+}
+
+void BenchColor() {
+    const size_t width = 1920;
+    std::vector<int16_t> y(width), cb(width), cr(width);
+    std::vector<int> r(width), g(width), b(width);
+    for (size_t i = 0; i < width; ++i) {
+        y[i] = i % 256;
+        cb[i] = (i * 7) % 256;
+        cr[i] = (i * 13) % 256;
+    }
+    std::printf("\n%-28s %10s\n", "ycbcr->rgb", "MP/s");
+    CpuLevel detected = DetectCpuLevel();
+    for (int level = 0; level <= static_cast<int>(detected); ++level) {
+        SetCpuLevel(static_cast<CpuLevel>(level));
+        const Kernels &kernels = GetKernels();
+        double seconds = Measure([&] {
+            kernels.ycbcr_to_rgb(y.data(), cb.data(), cr.data(), r.data(), g.data(), b.data(),
+                                 width);
+        });
+        std::printf("%-28s %10.1f\n", LevelName(static_cast<CpuLevel>(level)),
+                    width / 1e6 / seconds);
+    }
+    SetCpuLevel(detected);
+}
+
+}  // namespace
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+// std::pmr resources allocate through the aligned overloads.
+void *operator new(size_t size, std::align_val_t align) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    size_t alignment = std::max(static_cast<size_t>(align), sizeof(void *));
+    size = (std::max<size_t>(size, 1) + alignment - 1) / alignment * alignment;
+    if (void *p = std::aligned_alloc(alignment, size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+int main(int argc, char **argv) {
+    std::vector<Sample> corpus = LoadCorpus(argc > 1 ? argv[1] : nullptr);
+    std::printf("cpu level: %s\n\n", LevelName(GetCpuLevel()));
+    BenchDecode(corpus);
+    BenchHuffman(corpus);
+    BenchPrescan(corpus);
+    BenchTensor(corpus);
+    BenchBlocks();
+    BenchColor();
+    return 0;
+}
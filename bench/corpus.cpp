@@ -0,0 +1,207 @@
+#include "corpus.h"
+#include "../transcode.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// JPEG Annex K.1 tables in the natural order.
+const uint16_t kLumaTable[64] = { 16,  11,  10,  16,  24,  40,  51,  61,
+                                  12,  12,  14,  19,  26,  58,  60,  55,
+                                  14,  13,  16,  24,  40,  57,  69,  56,
+                                  14,  17,  22,  29,  51,  87,  80,  62,
+                                  18,  22,  37,  56,  68, 109, 103,  77,
+                                  24,  35,  55,  64,  81, 104, 113,  92,
+                                  49,  64,  78,  87, 103, 121, 120, 101,
+                                  72,  92,  95,  98, 112, 100, 103,  99};
+
+const uint16_t kChromaTable[64] = { 17,  18,  24,  47,  99,  99,  99,  99,
+                                    18,  21,  26,  66,  99,  99,  99,  99,
+                                    24,  26,  56,  99,  99,  99,  99,  99,
+                                    47,  66,  99,  99,  99,  99,  99,  99,
+                                    99,  99,  99,  99,  99,  99,  99,  99,
+                                    99,  99,  99,  99,  99,  99,  99,  99,
+                                    99,  99,  99,  99,  99,  99,  99,  99,
+                                    99,  99,  99,  99,  99,  99,  99,  99};
+
+// Small PRNG, std distributions aren't portable between standard libraries.
+class Random {
+private:
+    uint32_t state_;
+
+public:
+    explicit Random(uint32_t seed) : state_(seed ? seed : 1) {
+    }
+
+    uint32_t Next() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 17;
+        state_ ^= state_ << 5;
+        return state_;
+    }
+};
+
+// Table in the zigzag order scaled like IJG does.
+QT MakeQT(uint8_t id, const uint16_t *base, int quality) {
+    quality = std::clamp(quality, 1, 100);
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    QT qt{id, std::vector<uint16_t>(64)};
+    for (size_t i = 0; i < 64; ++i) {
+        int value = (base[kZigZag[i]] * scale + 50) / 100;
+        qt.table[i] = std::clamp(value, 1, 255);
+    }
+    return qt;
+}
+
+// Planes of Y, Cb and Cr with values in [0, 255].
+std::vector<std::vector<double>> MakePicture(const CorpusSpec &spec) {
+    Random random(spec.seed);
+    size_t size = static_cast<size_t>(spec.width) * spec.height;
+    std::vector<std::vector<double>> planes(3, std::vector<double>(size));
+    double cx = spec.width * 0.6, cy = spec.height * 0.4;
+    double radius = std::min(spec.width, spec.height) / 3.0;
+    for (size_t y = 0; y < spec.height; ++y) {
+        for (size_t x = 0; x < spec.width; ++x) {
+            double fx = static_cast<double>(x) / spec.width;
+            double fy = static_cast<double>(y) / spec.height;
+            double r = 255 * fx, g = 255 * fy, b = 128 + 100 * std::sin(10 * fx + 7 * fy);
+            double dx = x - cx, dy = y - cy;
+            if (dx * dx + dy * dy < radius * radius) {
+                r = 255 - r;
+                b = 40;
+            }
+            if ((x / 16 + y / 16) % 7 == 0) {
+                g = 255 - g;
+            }
+            double noise = static_cast<int>(random.Next() % 33) - 16;
+            r = std::clamp(r + noise, 0.0, 255.0);
+            g = std::clamp(g + noise, 0.0, 255.0);
+            b = std::clamp(b + noise, 0.0, 255.0);
+            size_t i = y * spec.width + x;
+            planes[0][i] = 0.299 * r + 0.587 * g + 0.114 * b;
+            planes[1][i] = 128 - 0.168736 * r - 0.331264 * g + 0.5 * b;
+            planes[2][i] = 128 + 0.5 * r - 0.418688 * g - 0.081312 * b;
+        }
+    }
+    return planes;
+}
+
+// Forward DCT of |samples| (level shifted) into |output| in the natural order.
+void ForwardDct(const double *samples, double *output) {
+    static std::vector<double> cosines = [] {
+        std::vector<double> result(64);
+        for (size_t x = 0; x < 8; ++x) {
+            for (size_t u = 0; u < 8; ++u) {
+                result[x * 8 + u] = std::cos((2 * x + 1) * u * M_PI / 16);
+            }
+        }
+        return result;
+    }();
+    double rows[64];
+    for (size_t y = 0; y < 8; ++y) {
+        for (size_t u = 0; u < 8; ++u) {
+            double sum = 0;
+            for (size_t x = 0; x < 8; ++x) {
+                sum += samples[y * 8 + x] * cosines[x * 8 + u];
+            }
+            rows[y * 8 + u] = sum * (u ? 0.5 : 0.5 / std::sqrt(2.0));
+        }
+    }
+    for (size_t u = 0; u < 8; ++u) {
+        for (size_t v = 0; v < 8; ++v) {
+            double sum = 0;
+            for (size_t y = 0; y < 8; ++y) {
+                sum += rows[y * 8 + u] * cosines[y * 8 + v];
+            }
+            output[v * 8 + u] = sum * (v ? 0.5 : 0.5 / std::sqrt(2.0));
+        }
+    }
+}
+
+}  // namespace
+
+std::string GenerateJpeg(const CorpusSpec &spec) {
+    if (!spec.width || !spec.height) {
+        throw std::invalid_argument("Bad corpus image size");
+    }
+    uint8_t h_max = spec.subsampling == Subsampling::k444 ? 1 : 2;
+    uint8_t v_max = spec.subsampling == Subsampling::k420 ? 2 : 1;
+
+    CoefImage image;
+    image.width = spec.width;
+    image.height = spec.height;
+    image.qts.push_back(MakeQT(0, kLumaTable, spec.quality));
+    image.qts.push_back(MakeQT(1, kChromaTable, spec.quality));
+    size_t mcu_width = (spec.width - 1) / (8 * h_max) + 1;
+    size_t mcu_height = (spec.height - 1) / (8 * v_max) + 1;
+    for (uint8_t c = 0; c < 3; ++c) {
+        CoefPlane plane{static_cast<uint8_t>(c + 1), static_cast<uint8_t>(c ? 1 : h_max),
+                        static_cast<uint8_t>(c ? 1 : v_max), static_cast<uint8_t>(c > 0), 0, 0, {}};
+        plane.width = mcu_width * plane.h_thinning;
+        plane.height = mcu_height * plane.v_thinning;
+        plane.coefs.assign(plane.width * plane.height * 64, 0);
+        image.planes.push_back(plane);
+    }
+
+    std::vector<std::vector<double>> picture = MakePicture(spec);
+    double samples[64], coefs[64];
+    for (size_t c = 0; c < 3; ++c) {
+        CoefPlane &plane = image.planes[c];
+        // Every sample of the plane covers the box of the picture pixels.
+        size_t box_width = h_max / plane.h_thinning, box_height = v_max / plane.v_thinning;
+        const QT &qt = image.qts[plane.qt_id];
+        for (size_t by = 0; by < plane.height; ++by) {
+            for (size_t bx = 0; bx < plane.width; ++bx) {
+                for (size_t i = 0; i < 64; ++i) {
+                    double sum = 0;
+                    for (size_t dy = 0; dy < box_height; ++dy) {
+                        for (size_t dx = 0; dx < box_width; ++dx) {
+                            // Edges are replicated into the padding.
+                            size_t y = std::min<size_t>(
+                                ((by * 8 + i / 8) * box_height + dy), spec.height - 1);
+                            size_t x = std::min<size_t>(((bx * 8 + i % 8) * box_width + dx),
+                                                        spec.width - 1);
+                            sum += picture[c][y * spec.width + x];
+                        }
+                    }
+                    samples[i] = sum / (box_width * box_height) - 128;
+                }
+                ForwardDct(samples, coefs);
+                int16_t *block = &plane.coefs[(by * plane.width + bx) * 64];
+                for (size_t i = 0; i < 64; ++i) {
+                    block[kZigZag[i]] =
+                        static_cast<int16_t>(std::lround(coefs[kZigZag[i]] / qt.table[i]));
+                }
+            }
+        }
+    }
+
+    std::ostringstream output;
+    WriteCoefImage(image, output);
+    return output.str();
+}
+
+std::string CorpusName(const CorpusSpec &spec) {
+    const char *subsampling = spec.subsampling == Subsampling::k444   ? "444"
+                              : spec.subsampling == Subsampling::k422 ? "422"
+                                                                      : "420";
+    return std::to_string(spec.width) + "x" + std::to_string(spec.height) + "_q" +
+           std::to_string(spec.quality) + "_" + subsampling + ".jpg";
+}
+
+std::vector<CorpusSpec> DefaultCorpus() {
+    std::vector<CorpusSpec> corpus;
+    const std::pair<uint16_t, uint16_t> sizes[] = {{64, 64}, {333, 251}, {640, 480}, {1920, 1080}};
+    for (const auto &[width, height] : sizes) {
+        for (int quality : {50, 75, 95}) {
+            for (Subsampling subsampling :
+                 {Subsampling::k444, Subsampling::k422, Subsampling::k420}) {
+                corpus.push_back({width, height, quality, subsampling});
+            }
+        }
+    }
+    return corpus;
+}
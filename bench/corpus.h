@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class Subsampling {
+    k444,
+    k422,
+    k420,
+};
+
+struct CorpusSpec {
+    uint16_t width;
+    uint16_t height;
+    // IJG quality, 1..100.
+    int quality;
+    Subsampling subsampling;
+    uint32_t seed = 1;
+};
+
+// Baseline YCbCr JPEG of a synthetic picture (gradients, edges and noise). The
+// output depends only on |spec|, so the corpus is the same on every machine.
+std::string GenerateJpeg(const CorpusSpec &spec);
+
+// File name like "640x480_q75_420.jpg".
+std::string CorpusName(const CorpusSpec &spec);
+
+// Sizes, qualities and subsampling modes used by the benchmarks.
+std::vector<CorpusSpec> DefaultCorpus();
@@ -0,0 +1,23 @@
+// Writes the benchmark corpus into the directory given as the first argument.
+#include "corpus.h"
+
+#include <fstream>
+#include <iostream>
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <output_dir>\n";
+        return 1;
+    }
+    for (const CorpusSpec &spec : DefaultCorpus()) {
+        std::string path = std::string(argv[1]) + "/" + CorpusName(spec);
+        std::ofstream output(path, std::ios::binary);
+        std::string jpeg = GenerateJpeg(spec);
+        output.write(jpeg.data(), jpeg.size());
+        if (!output) {
+            std::cerr << "Can't write " << path << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -1,30 +1,129 @@
 #include "decoder.h"
 #include "fft.h"
+#include "kernels.h"
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <optional>
 
-BitReader::BitReader(std::istream &input) : input_(input) {
+BitReader::BitReader(const uint8_t *data, size_t size) : data_(data), size_(size) {
 }
 
 bool BitReader::ReadBit() {
     if (cur_pos_ == 8) {
-        if (input_.eof()) {
+        if (pos_ == size_) {
             throw std::invalid_argument("EOF(BitReader)");
         }
-        buf_ = input_.get();
-        if (is_cur_byte_ff_) {
-            if (input_.eof()) {
-                throw std::invalid_argument("EOF(BitReader)");
+        buf_ = data_[pos_++];
+        cur_pos_ = 0;
+    }
+    return buf_ & (1 << (8 - ++cur_pos_));
+}
+
+namespace {
+
+const size_t kEntropyBlockSize = 1 << 16;
+
+// Handles the byte after 0xff. Returns false if the byte starts the marker
+// which ends the segment.
+bool ReadAfterFF(uint8_t byte, EntropySegment &segment) {
+    if (byte == 0x00) {
+        segment.data.push_back(0xff);
+    } else if (byte >= 0xd0 && byte <= 0xd7) {
+        segment.restarts.push_back(segment.data.size());
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void ReadEntropyBlocks(std::istream &input, std::streampos begin, EntropySegment &segment,
+                       std::pmr::memory_resource *resource) {
+    const Kernels &kernels = GetKernels();
+    std::pmr::vector<uint8_t> block(kEntropyBlockSize, resource);
+    size_t offset = 0;
+    bool after_ff = false;
+    while (true) {
+        input.read(reinterpret_cast<char *>(block.data()), block.size());
+        size_t count = input.gcount();
+        if (!count) {
+            throw std::invalid_argument("Bad EOF(SOS)");
+        }
+        size_t i = 0;
+        while (i < count) {
+            if (after_ff) {
+                // More 0xff bytes are fill bytes before a marker.
+                if (block[i] != 0xff) {
+                    if (!ReadAfterFF(block[i], segment)) {
+                        segment.size = offset + i - 1;
+                        input.clear();
+                        input.seekg(begin + static_cast<std::streamoff>(segment.size));
+                        return;
+                    }
+                    after_ff = false;
+                }
+                ++i;
+                continue;
+            }
+            size_t ff = i + kernels.find_ff(&block[i], count - i);
+            segment.data.insert(segment.data.end(), block.begin() + i, block.begin() + ff);
+            if (ff == count) {
+                break;
             }
-            buf_ = input_.get();
-            is_cur_byte_ff_ = false;
+            after_ff = true;
+            i = ff + 1;
         }
-        if (buf_ == 0xff) {
-            is_cur_byte_ff_ = true;
+        offset += count;
+    }
+}
+
+void ReadEntropyBytes(std::istream &input, EntropySegment &segment) {
+    const auto eof = std::istream::traits_type::eof();
+    while (true) {
+        auto byte = input.get();
+        if (byte == eof) {
+            throw std::invalid_argument("Bad EOF(SOS)");
         }
-        cur_pos_ = 0;
+        ++segment.size;
+        if (byte != 0xff) {
+            segment.data.push_back(byte);
+            continue;
+        }
+        while (input.peek() == 0xff) {
+            input.get();
+            ++segment.size;
+        }
+        auto next = input.peek();
+        if (next == eof) {
+            throw std::invalid_argument("Bad EOF(SOS)");
+        }
+        if (!ReadAfterFF(next, segment)) {
+            input.unget();
+            --segment.size;
+            return;
+        }
+        input.get();
+        ++segment.size;
     }
-    return buf_ & (1 << (8 - ++cur_pos_));
+}
+
+}  // namespace
+
+EntropySegment ReadEntropySegment(std::istream &input, size_t expected_size,
+                                  std::pmr::memory_resource *resource) {
+    EntropySegment segment{std::pmr::vector<uint8_t>(resource),
+                           std::pmr::vector<size_t>(resource)};
+    std::streampos begin = input.tellg();
+    if (begin == std::streampos(-1)) {
+        ReadEntropyBytes(input, segment);
+        return segment;
+    }
+    // The segment is never longer than the rest of the input.
+    input.seekg(0, std::ios::end);
+    segment.data.reserve(std::min<size_t>(input.tellg() - begin, expected_size));
+    input.seekg(begin);
+    ReadEntropyBlocks(input, begin, segment, resource);
+    return segment;
 }
 
 uint16_t TwoBytes::GetSize() {
@@ -92,16 +191,18 @@ std::string ReadCOM(std::istream &input) {
     return ans;
 }
 
-void ReadAPPn(std::istream &input) {
+std::string ReadAPPn(std::istream &input) {
     TwoBytes tb_size = Read2Bytes(input);
-    uint16_t size =
-        static_cast<uint16_t>(tb_size.first) << 8 | static_cast<uint16_t>(tb_size.second);
-    for (uint16_t i = 0; i < size - 2; ++i) {
-        if (input.eof()) {
-            throw std::invalid_argument("Bad EOF(COM)");
-        }
-        input.get();
+    uint16_t size = tb_size.GetSize();
+    if (size < 2) {
+        throw std::invalid_argument("Bad size(APPn)");
+    }
+    std::string payload(size - 2, '\0');
+    input.read(payload.data(), payload.size());
+    if (input.gcount() != static_cast<std::streamsize>(payload.size())) {
+        throw std::invalid_argument("Bad EOF(APPn)");
     }
+    return payload;
 }
 
 uint8_t CheckID(uint8_t id) {
@@ -148,8 +249,8 @@ void ReadDQT(std::istream &input, std::vector<QT> &qts) {
     }
 }
 
-uint8_t ReadSOF(std::istream &input, std::map<uint8_t, Channel> &channels, Image &image,
-                std::vector<QT> &qts) {
+uint8_t ReadSOF(std::istream &input, std::map<uint8_t, Channel> &channels, uint16_t &width,
+                uint16_t &height, std::vector<QT> &qts) {
     TwoBytes tb_size = Read2Bytes(input);
     uint16_t size = tb_size.GetSize();
     if (input.eof()) {
@@ -157,9 +258,9 @@ uint8_t ReadSOF(std::istream &input, std::map<uint8_t, Channel> &channels, Image
     }
     uint8_t precision = input.get();
     TwoBytes tb_height = Read2Bytes(input);
-    uint16_t height = tb_height.GetSize();
+    height = tb_height.GetSize();
     TwoBytes tb_width = Read2Bytes(input);
-    uint16_t width = tb_width.GetSize();
+    width = tb_width.GetSize();
     if (static_cast<uint64_t>(height) * static_cast<uint64_t>(width) >
         static_cast<uint64_t>(80'000'000)) {
         throw std::invalid_argument("Size is too big(SOF)");
@@ -167,7 +268,6 @@ uint8_t ReadSOF(std::istream &input, std::map<uint8_t, Channel> &channels, Image
     if (width == 0 || height == 0) {
         throw std::invalid_argument("Width or height == 0(SOF)");
     }
-    image.SetSize(width, height);
     if (input.eof()) {
         throw std::invalid_argument("Bad EOF(SOF)");
     }
@@ -202,6 +302,14 @@ uint8_t ReadSOF(std::istream &input, std::map<uint8_t, Channel> &channels, Image
     return precision;
 }
 
+uint8_t ReadSOF(std::istream &input, std::map<uint8_t, Channel> &channels, Image &image,
+                std::vector<QT> &qts) {
+    uint16_t width, height;
+    uint8_t precision = ReadSOF(input, channels, width, height, qts);
+    image.SetSize(width, height);
+    return precision;
+}
+
 void ReadDHT(std::istream &input, std::map<uint8_t, HuffmanTable> &hts) {
     TwoBytes tb_size = Read2Bytes(input);
     uint16_t size = tb_size.GetSize();
@@ -248,7 +356,7 @@ void ReadDHT(std::istream &input, std::map<uint8_t, HuffmanTable> &hts) {
     }
 }
 
-void DecodeZigZag(std::vector<double> &&input, std::vector<double> &output) {
+void DecodeZigZag(const std::pmr::vector<double> &input, std::pmr::vector<double> &output) {
     int dx = -1, dy = 1;
     int x = 0, y = 0;
     int inc_x = 0, inc_y = 1;
@@ -278,8 +386,8 @@ void DecodeZigZag(std::vector<double> &&input, std::vector<double> &output) {
     output[63] = input[63];
 }
 
-void ReadCoefs(BitReader &br, std::vector<HuffmanTree> &trees, std::vector<uint16_t> &table,
-               uint8_t channel) {
+size_t ReadCoefs(BitReader &br, std::vector<HuffmanTree> &trees, std::pmr::vector<uint16_t> &table,
+                 uint8_t channel) {
     size_t cnt = 0;
     int dc_size = 0;
     bool bit;
@@ -307,10 +415,7 @@ void ReadCoefs(BitReader &br, std::vector<HuffmanTree> &trees, std::vector<uint1
 
     cnt = 0;
     uint8_t table_pos = 1;
-    while (true) {
-        if (table_pos == 64) {
-            break;
-        }
+    while (table_pos < 64) {
         int code = 0;
         cnt = 0;
         while (!trees[(channel - 1) * 2 + 1].Move((bit = br.ReadBit()), code)) {
@@ -345,43 +450,33 @@ void ReadCoefs(BitReader &br, std::vector<HuffmanTree> &trees, std::vector<uint1
         }
         table[table_pos++] = ac_value;
     }
+    return table_pos;
 }
 
-std::vector<double> QTDevide(std::vector<uint16_t> &table, std::vector<uint16_t> &qt) {
-    std::vector<double> t_for_fft(64);
+void QTDevide(const std::pmr::vector<uint16_t> &table, const std::vector<uint16_t> &qt,
+              std::pmr::vector<double> &output) {
     for (size_t i = 0; i < 64; ++i) {
         int16_t el = static_cast<int16_t>(table[i]);
         el *= qt[i];
-        t_for_fft[i] = static_cast<double>(el);
+        output[i] = static_cast<double>(el);
     }
-    return t_for_fft;
 }
 
-void Norm(std::vector<double> &table, std::vector<int16_t> &norm_table) {
-    int16_t min_el = 0, max_el = 255;
-    for (size_t i = 0; i < table.size(); ++i) {
-        table[i] += 128;
-        norm_table[i] = static_cast<int16_t>(table[i]);
-        norm_table[i] = std::min(norm_table[i], max_el);
-        norm_table[i] = std::max(norm_table[i], min_el);
-    }
+void Norm(const std::pmr::vector<double> &table, std::pmr::vector<int16_t> &norm_table) {
+    GetKernels().norm(table.data(), norm_table.data(), table.size());
 }
 
 void YCbCrToRGB(int16_t y, int16_t cb, int16_t cr, Image &image, int i, int j) {
     RGB rgb;
-    rgb.r = round(y + 1.402 * (cr - 128));
-    rgb.g = round(y - 0.34414 * (cb - 128) - 0.71414 * (cr - 128));
-    rgb.b = round(y + 1.772 * (cb - 128));
-    rgb.r = std::min(std::max(0, rgb.r), 255);
-    rgb.g = std::min(std::max(0, rgb.g), 255);
-    rgb.b = std::min(std::max(0, rgb.b), 255);
+    GetKernels().ycbcr_to_rgb(&y, &cb, &cr, &rgb.r, &rgb.g, &rgb.b, 1);
     if (static_cast<size_t>(i) < image.Height() && static_cast<size_t>(j) < image.Width()) {
         image.SetPixel(i, j, rgb);
     }
 }
 
-void ReadSOS(std::istream &input, std::map<uint8_t, Channel> &channels,
-             std::map<uint8_t, HuffmanTable> &hts, Image &image, std::vector<QT> &qts) {
+std::vector<uint8_t> ReadSOSHeader(std::istream &input, std::map<uint8_t, Channel> &channels,
+                                   std::map<uint8_t, HuffmanTable> &hts,
+                                   std::vector<HuffmanTree> &trees) {
     TwoBytes tb_size = Read2Bytes(input);
     uint16_t size = tb_size.GetSize();
     if (!size) {
@@ -397,7 +492,6 @@ void ReadSOS(std::istream &input, std::map<uint8_t, Channel> &channels,
     if (count_channels * 2 != size - 6) {
         throw std::invalid_argument("Bad size(SOS)");
     }
-    std::vector<HuffmanTree> trees(6);
     std::vector<uint8_t> component_channels(count_channels);
     for (uint16_t i = 0; i < count_channels; ++i) {
         if (input.eof()) {
@@ -442,117 +536,381 @@ void ReadSOS(std::istream &input, std::map<uint8_t, Channel> &channels,
     if (input.get() != 0x00) {
         throw std::invalid_argument("Bad progressive param(SOS)");
     }
+    return component_channels;
+}
+
+LimitedMemoryResource::LimitedMemoryResource(std::pmr::memory_resource *upstream, size_t limit)
+    : upstream_(upstream), limit_(limit) {
+}
+
+void *LimitedMemoryResource::do_allocate(size_t bytes, size_t alignment) {
+    if (bytes > limit_ - used_) {
+        throw std::invalid_argument("Memory limit exceeded");
+    }
+    void *p = upstream_->allocate(bytes, alignment);
+    used_ += bytes;
+    peak_ = std::max(peak_, used_);
+    return p;
+}
+
+void LimitedMemoryResource::do_deallocate(void *p, size_t bytes, size_t alignment) {
+    upstream_->deallocate(p, bytes, alignment);
+    used_ -= bytes;
+}
+
+bool LimitedMemoryResource::do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+    return this == &other;
+}
+
+size_t LimitedMemoryResource::Peak() const {
+    return peak_;
+}
+
+size_t EstimatePeakMemory(uint16_t width, uint16_t height,
+                          const std::map<uint8_t, Channel> &channels, size_t output_bytes) {
+    size_t blocks = 0;
+    size_t mcu_width = 8, mcu_height = 8;
+    for (const auto &[id, channel] : channels) {
+        blocks = std::max<size_t>(blocks, (channel.thinning >> 4) * (channel.thinning % 16));
+        mcu_width = std::max<size_t>(mcu_width, 8 * (channel.thinning >> 4));
+        mcu_height = std::max<size_t>(mcu_height, 8 * (channel.thinning % 16));
+    }
+    // Luma blocks of MCU and one block of every chroma component.
+    blocks += 2;
+    size_t row_width = ((width - 1) / mcu_width + 1) * mcu_width;
+    size_t working = blocks * 64 * sizeof(int16_t) + 64 * sizeof(uint16_t) +
+                     3 * 64 * sizeof(double) + 6 * HuffmanTree::EstimateBytes() +
+                     3 * row_width * mcu_height * sizeof(int16_t) + 3 * row_width * sizeof(int);
+    // Destuffed entropy coded data, assuming it is smaller than raw samples,
+    // and the block it is read by.
+    working += static_cast<size_t>(width) * height * channels.size() + kEntropyBlockSize;
+    return output_bytes + working;
+}
+
+DecodeGuard::DecodeGuard(const DecodeOptions &options) : cancelled_(options.cancelled) {
+    if (options.time_budget != std::chrono::steady_clock::duration::zero()) {
+        deadline_ = std::chrono::steady_clock::now() + options.time_budget;
+        has_deadline_ = true;
+    }
+}
+
+DecodeStatus DecodeGuard::Check() const {
+    if (cancelled_ && cancelled_->load(std::memory_order_relaxed)) {
+        return DecodeStatus::kCancelled;
+    }
+    if (has_deadline_ && std::chrono::steady_clock::now() >= deadline_) {
+        return DecodeStatus::kDeadlineExceeded;
+    }
+    return DecodeStatus::kOk;
+}
+
+namespace {
+
+#ifdef JPEG_DECODE_STATS
+constexpr bool kDecodeStats = true;
+#else
+constexpr bool kDecodeStats = false;
+#endif
+
+// Splits the decode time between the stages of DecodeStats. Does nothing if
+// the stats aren't requested or compiled in.
+class StageClock {
+private:
+    DecodeStats *stats_;
+    std::chrono::steady_clock::time_point last_;
+
+public:
+    explicit StageClock(DecodeStats *stats) : stats_(kDecodeStats ? stats : nullptr) {
+        if (stats_) {
+            last_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    // Adds the time since the previous lap to |stage|.
+    void Lap(std::chrono::steady_clock::duration DecodeStats::*stage) {
+        if (stats_) {
+            auto now = std::chrono::steady_clock::now();
+            stats_->*stage += now - last_;
+            last_ = now;
+        }
+    }
+};
+
+class CountingMemoryResource : public std::pmr::memory_resource {
+private:
+    std::pmr::memory_resource *upstream_;
+    size_t &allocations_;
+
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        ++allocations_;
+        return upstream_->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        upstream_->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    CountingMemoryResource(std::pmr::memory_resource *upstream, size_t &allocations)
+        : upstream_(upstream), allocations_(allocations) {
+    }
+};
+
+// Converts rows of samples to RGB pixels of |image|.
+class ImageRowWriter {
+private:
+    Image &image_;
+    const Kernels &kernels_;
+    std::pmr::vector<int> r_, g_, b_;
+
+public:
+    ImageRowWriter(Image &image, std::pmr::memory_resource *resource)
+        : image_(image), kernels_(GetKernels()), r_(image.Width(), resource),
+          g_(image.Width(), resource), b_(image.Width(), resource) {
+    }
+
+    void operator()(size_t row, const int16_t *y, const int16_t *cb, const int16_t *cr,
+                    size_t width) {
+        kernels_.ycbcr_to_rgb(y, cb, cr, r_.data(), g_.data(), b_.data(), width);
+        for (size_t j = 0; j < width; ++j) {
+            image_.SetPixel(row, j, {r_[j], g_[j], b_[j]});
+        }
+    }
+};
+
+}  // namespace
+
+DecodeStatus ReadSOSSamples(std::istream &input, std::map<uint8_t, Channel> &channels,
+                            std::map<uint8_t, HuffmanTable> &hts, std::vector<QT> &qts,
+                            uint16_t image_width, uint16_t image_height, size_t scale,
+                            const SampleRowSink &sink, const DecodeGuard &guard,
+                            std::pmr::memory_resource *resource, size_t &valid_rows,
+                            DecodeStats *stats) {
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+        throw std::invalid_argument("Bad scale");
+    }
+    if (!kDecodeStats) {
+        stats = nullptr;
+    }
+    StageClock clock(stats);
+    std::vector<HuffmanTree> trees;
+    trees.reserve(6);
+    for (size_t i = 0; i < 6; ++i) {
+        trees.emplace_back(resource);
+    }
+    std::vector<uint8_t> component_channels = ReadSOSHeader(input, channels, hts, trees);
+    clock.Lap(&DecodeStats::markers);
+    EntropySegment segment = ReadEntropySegment(
+        input, static_cast<size_t>(image_width) * image_height * channels.size(), resource);
+    clock.Lap(&DecodeStats::prescan);
+    if (stats) {
+        // Every 0xff of the destuffed data was followed by a stuffed byte.
+        stats->stuffed_bytes += std::count(segment.data.begin(), segment.data.end(), 0xff);
+    }
+    size_t count_channels = component_channels.size();
 
     // INIT
     uint8_t y_thinning = channels[component_channels[0]].thinning;
     uint8_t y_g_thinning = y_thinning >> 4;
     uint8_t y_v_thinning = y_thinning % 16;
-    size_t width = (image.Width() - 1) / (8 * y_g_thinning) + 1;
-    size_t height = (image.Height() - 1) / (8 * y_v_thinning) + 1;
-    BitReader br(input);
+    size_t width = (image_width - 1) / (8 * y_g_thinning) + 1;
+    size_t height = (image_height - 1) / (8 * y_v_thinning) + 1;
+    // Side of the decoded block and size of the output.
+    size_t block = 8 / scale;
+    size_t output_width = (image_width - 1) / scale + 1;
+    size_t output_height = (image_height - 1) / scale + 1;
+    BitReader br(segment.data.data(), segment.data.size());
     uint16_t last_dc_y = 0;
     uint16_t last_dc_cb = 0;
     uint16_t last_dc_cr = 0;
 
-    std::vector<double> dct_input(64);
-    std::vector<double> dct_output(64);
+    // Working buffers are allocated once per scan and reused by every block.
+    std::pmr::vector<uint16_t> coefs(64, resource);
+    std::pmr::vector<double> dequantized(64, resource);
+    std::pmr::vector<double> dct_input(64, resource);
+    std::pmr::vector<double> dct_output(64, resource);
     DctCalculator dct(8, &dct_input, &dct_output);
+    std::pmr::vector<double> reduced(block * block, resource);
+    std::pmr::vector<std::pmr::vector<int16_t>> norm_y(resource);
+    norm_y.assign(y_v_thinning * y_g_thinning, std::pmr::vector<int16_t>(block * block));
+    std::pmr::vector<int16_t> norm_cb(block * block, 128, resource);
+    std::pmr::vector<int16_t> norm_cr(block * block, 128, resource);
+    // Samples of one MCU row, chroma is already upsampled. Passed to |sink| row
+    // by row when the MCU row is complete.
+    size_t row_width = width * block * y_g_thinning;
+    size_t mcu_rows = block * y_v_thinning;
+    std::pmr::vector<int16_t> y_rows(row_width * mcu_rows, resource);
+    std::pmr::vector<int16_t> cb_rows(row_width * mcu_rows, 128, resource);
+    std::pmr::vector<int16_t> cr_rows(row_width * mcu_rows, 128, resource);
+
+    // IDCT of |dct_input| into |samples|, reduced to block x block if scaled.
+    auto inverse = [&](std::pmr::vector<int16_t> &samples) {
+        if (block == 8) {
+            dct.Inverse();
+            Norm(dct_output, samples);
+        } else {
+            InverseDctReduced(dct_input, block, reduced);
+            Norm(reduced, samples);
+        }
+    };
 
+    valid_rows = 0;
     for (size_t ix = 0; ix < height; ++ix) {
+        DecodeStatus status = guard.Check();
+        if (status != DecodeStatus::kOk) {
+            return status;
+        }
         for (size_t iy = 0; iy < width; ++iy) {
             // 1st channel
-            std::vector<std::vector<uint16_t>> y(y_v_thinning * y_g_thinning,
-                                                 std::vector<uint16_t>(64, 0));
-            std::vector<std::vector<double>> new_y(y_v_thinning * y_g_thinning,
-                                                   std::vector<double>(64, 0));
-            std::vector<std::vector<int16_t>> norm_y(y_v_thinning * y_g_thinning,
-                                                     std::vector<int16_t>(64, 0));
             // calculate AC and DC for y
             for (size_t j = 0; j < y_g_thinning * y_v_thinning; ++j) {
                 // calculate DC and all AC for y[j]
-                ReadCoefs(br, trees, y[j], 1);
-                y[j][0] += last_dc_y;
-                last_dc_y = y[j][0];
-                DecodeZigZag(QTDevide(y[j], qts[channels[component_channels[0]].qt_id].table),
-                             new_y[j]);
-                dct_input = new_y[j];
-                dct.Inverse();
-                Norm(dct_output, norm_y[j]);
+                std::fill(coefs.begin(), coefs.end(), 0);
+                size_t end = ReadCoefs(br, trees, coefs, 1);
+                clock.Lap(&DecodeStats::entropy);
+                coefs[0] += last_dc_y;
+                last_dc_y = coefs[0];
+                QTDevide(coefs, qts[channels[component_channels[0]].qt_id].table, dequantized);
+                DecodeZigZag(dequantized, dct_input);
+                inverse(norm_y[j]);
+                clock.Lap(&DecodeStats::idct);
+                if (stats) {
+                    ++stats->blocks;
+                    stats->eob_blocks += end < 64;
+                }
             }
 
             // 2nd channel (Cb)
-            std::vector<uint16_t> cb(64, 0);
-            std::vector<double> new_cb(64, 0);
-            std::vector<int16_t> norm_cb(64, 0);
             if (count_channels > 1) {
                 // calculate DC and all AC for cb
-                ReadCoefs(br, trees, cb, 2);
-                cb[0] += last_dc_cb;
-                last_dc_cb = cb[0];
-                DecodeZigZag(QTDevide(cb, qts[channels[component_channels[1]].qt_id].table),
-                             new_cb);
-                dct_input = new_cb;
-                dct.Inverse();
-                Norm(dct_output, norm_cb);
+                std::fill(coefs.begin(), coefs.end(), 0);
+                size_t end = ReadCoefs(br, trees, coefs, 2);
+                clock.Lap(&DecodeStats::entropy);
+                coefs[0] += last_dc_cb;
+                last_dc_cb = coefs[0];
+                QTDevide(coefs, qts[channels[component_channels[1]].qt_id].table, dequantized);
+                DecodeZigZag(dequantized, dct_input);
+                inverse(norm_cb);
+                clock.Lap(&DecodeStats::idct);
+                if (stats) {
+                    ++stats->blocks;
+                    stats->eob_blocks += end < 64;
+                }
             }
 
             // 3rd channel (Cr)
-            std::vector<uint16_t> cr(64, 0);
-            std::vector<double> new_cr(64, 0);
-            std::vector<int16_t> norm_cr(64, 0);
             if (count_channels > 2) {
                 // calculate DC and all AC for cr
-                ReadCoefs(br, trees, cr, 3);
-                cr[0] += last_dc_cr;
-                last_dc_cr = cr[0];
-                DecodeZigZag(QTDevide(cr, qts[channels[component_channels[2]].qt_id].table),
-                             new_cr);
-                dct_input = new_cr;
-                dct.Inverse();
-                Norm(dct_output, norm_cr);
+                std::fill(coefs.begin(), coefs.end(), 0);
+                size_t end = ReadCoefs(br, trees, coefs, 3);
+                clock.Lap(&DecodeStats::entropy);
+                coefs[0] += last_dc_cr;
+                last_dc_cr = coefs[0];
+                QTDevide(coefs, qts[channels[component_channels[2]].qt_id].table, dequantized);
+                DecodeZigZag(dequantized, dct_input);
+                inverse(norm_cr);
+                clock.Lap(&DecodeStats::idct);
+                if (stats) {
+                    ++stats->blocks;
+                    stats->eob_blocks += end < 64;
+                }
             }
-            for (size_t i = 0; i < 8 * y_v_thinning; ++i) {
-                for (size_t j = 0; j < 8 * y_g_thinning; ++j) {
-                    size_t l = 0;
-                    if (i > 7) {
-                        l = y_g_thinning;
-                    }
-                    l += j >> 3;
-                    int16_t first = norm_y[l][(i % 8) * 8 + j % 8], second = 128, third = 128;
+            for (size_t i = 0; i < mcu_rows; ++i) {
+                for (size_t j = 0; j < block * y_g_thinning; ++j) {
+                    size_t l = (i / block) * y_g_thinning + j / block;
+                    size_t pos = i * row_width + iy * block * y_g_thinning + j;
+                    size_t chroma = (i / y_v_thinning) * block + j / y_g_thinning;
+                    y_rows[pos] = norm_y[l][(i % block) * block + j % block];
                     if (count_channels > 1) {
-                        second = norm_cb[round(i / y_v_thinning) * 8 + round(j / y_g_thinning)];
+                        cb_rows[pos] = norm_cb[chroma];
                     }
                     if (count_channels > 2) {
-                        third = norm_cr[round(i / y_v_thinning) * 8 + round(j / y_g_thinning)];
+                        cr_rows[pos] = norm_cr[chroma];
                     }
-                    YCbCrToRGB(first, second, third, image, ix * 8 * y_v_thinning + i,
-                               iy * 8 * y_g_thinning + j);
                 }
             }
+            clock.Lap(&DecodeStats::color);
+        }
+        for (size_t i = 0; i < mcu_rows && ix * mcu_rows + i < output_height; ++i) {
+            size_t pos = i * row_width;
+            sink(ix * mcu_rows + i, &y_rows[pos], &cb_rows[pos], &cr_rows[pos], output_width);
+        }
+        clock.Lap(&DecodeStats::color);
+        valid_rows = std::min(output_height, (ix + 1) * mcu_rows);
+        if (stats) {
+            stats->mcus += width;
         }
     }
+    return DecodeStatus::kOk;
+}
+
+DecodeStatus ReadSOS(std::istream &input, std::map<uint8_t, Channel> &channels,
+                     std::map<uint8_t, HuffmanTable> &hts, Image &image, std::vector<QT> &qts,
+                     const DecodeGuard &guard, std::pmr::memory_resource *resource,
+                     size_t &valid_rows, DecodeStats *stats) {
+    ImageRowWriter writer(image, resource);
+    return ReadSOSSamples(input, channels, hts, qts, image.Width(), image.Height(), 1,
+                          std::ref(writer), guard, resource, valid_rows, stats);
+}
+
+void ReadSOS(std::istream &input, std::map<uint8_t, Channel> &channels,
+             std::map<uint8_t, HuffmanTable> &hts, Image &image, std::vector<QT> &qts) {
+    size_t valid_rows;
+    ReadSOS(input, channels, hts, image, qts, DecodeGuard(), std::pmr::get_default_resource(),
+            valid_rows);
 }
 
 Image Decode(std::istream &input) {
+    return Decode(input, DecodeOptions()).image;
+}
+
+DecodeStatus DecodeSamples(std::istream &input, const DecodeOptions &options,
+                           SampleTarget &target, size_t &valid_rows, std::string *comment) {
+    DecodeGuard guard(options);
+    std::pmr::memory_resource *resource = options.memory_resource
+                                              ? options.memory_resource
+                                              : std::pmr::get_default_resource();
+    std::optional<LimitedMemoryResource> limited_resource;
+    DecodeStats *stats = kDecodeStats ? options.stats : nullptr;
+    std::optional<CountingMemoryResource> counting_resource;
+    std::streampos start;
+    if (stats) {
+        counting_resource.emplace(resource, stats->allocations);
+        resource = &*counting_resource;
+        start = input.tellg();
+    }
+    auto count_bytes = [&] {
+        std::streampos end = input.tellg();
+        if (start != std::streampos(-1) && end != std::streampos(-1)) {
+            stats->bytes += end - start;
+        }
+    };
+    StageClock clock(stats);
     TwoBytes soi_marker = Read2Bytes(input);
     if (!soi_marker.IsSOI()) {
         throw std::invalid_argument("First marker isn't SOI");
     }
     TwoBytes marker;
-
-    Image image;
+    // Declared after the resources, so its buffers are freed while they exist.
+    SampleRowSink sink;
 
     bool was_dqt = false;
     std::vector<QT> qts;
 
     bool was_header = false;
     std::map<uint8_t, Channel> channels;
+    uint16_t width = 0, height = 0;
     uint8_t precision = 8;
 
     bool was_dht = false;
     std::map<uint8_t, HuffmanTable> hts;
 
     bool was_sos = false;
+    valid_rows = 0;
     while (true) {
         if (input.eof()) {
             throw std::invalid_argument("This input hasn't EOI");
@@ -569,7 +927,9 @@ Image Decode(std::istream &input) {
         }
         if (marker.IsCOM()) {
             std::string com = ReadCOM(input);
-            image.SetComment(com);
+            if (comment) {
+                *comment = com;
+            }
         } else if (marker.IsAPPn()) {
             ReadAPPn(input);
         } else if (marker.IsDQT()) {
@@ -579,10 +939,21 @@ Image Decode(std::istream &input) {
             if (was_header) {
                 throw std::invalid_argument("More than one header");
             }
-            precision = ReadSOF(input, channels, image, qts);
+            precision = ReadSOF(input, channels, width, height, qts);
             if (precision != 8) {
                 throw std::invalid_argument("Precision isn't 8(SOF)");
             }
+            size_t output = target.bytes(width, height);
+            if (options.memory_limit) {
+                size_t estimate = EstimatePeakMemory(width, height, channels, output);
+                if (estimate > options.memory_limit) {
+                    throw std::invalid_argument("Memory limit exceeded(SOF)");
+                }
+                // The rest of the budget is left for the working memory.
+                limited_resource.emplace(resource, options.memory_limit - output);
+                resource = &*limited_resource;
+            }
+            sink = target.init(width, height, resource);
             was_header = true;
         } else if (marker.IsDHT()) {
             ReadDHT(input, hts);
@@ -591,11 +962,56 @@ Image Decode(std::istream &input) {
             if (!was_header || !was_dht || !was_dqt) {
                 throw std::invalid_argument("SOS without SOF/DQT/DHT");
             }
-            ReadSOS(input, channels, hts, image, qts);
+            clock.Lap(&DecodeStats::markers);
+            DecodeStatus status =
+                ReadSOSSamples(input, channels, hts, qts, width, height, target.scale, sink,
+                               guard, resource, valid_rows, stats);
+            // ReadSOSSamples accounts its own time.
+            clock = StageClock(stats);
+            if (status != DecodeStatus::kOk) {
+                if (stats) {
+                    count_bytes();
+                }
+                return status;
+            }
             was_sos = true;
         } else {
             throw std::invalid_argument("Else");
         }
+        clock.Lap(&DecodeStats::markers);
+    }
+    if (stats) {
+        count_bytes();
     }
-    return image;
+    return DecodeStatus::kOk;
+}
+
+DecodeResult Decode(std::istream &input, const DecodeOptions &options) {
+    return DecodeScaled(input, options, [](uint16_t, uint16_t) { return 1; });
+}
+
+DecodeResult DecodeScaled(std::istream &input, const DecodeOptions &options,
+                          const ScaleChooser &choose_scale) {
+    DecodeResult result;
+    Image &image = result.image;
+    SampleTarget target;
+    target.bytes = [&](uint16_t width, uint16_t height) {
+        target.scale = choose_scale(width, height);
+        if (target.scale != 1 && target.scale != 2 && target.scale != 4 && target.scale != 8) {
+            throw std::invalid_argument("Bad scale");
+        }
+        return ((width - 1) / target.scale + 1) * ((height - 1) / target.scale + 1) * sizeof(RGB);
+    };
+    target.init = [&](uint16_t width, uint16_t height, std::pmr::memory_resource *resource) {
+        image.SetSize((width - 1) / target.scale + 1, (height - 1) / target.scale + 1);
+        return SampleRowSink(ImageRowWriter(image, resource));
+    };
+    std::string comment;
+    result.status = DecodeSamples(input, options, target, result.valid_rows, &comment);
+    image.SetComment(comment);
+    if (result.status != DecodeStatus::kOk && !options.allow_partial) {
+        image = Image();
+        result.valid_rows = 0;
+    }
+    return result;
 }
@@ -2,23 +2,50 @@
 
 #include "utils/image.h"
 #include "huffman.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <istream>
 #include <map>
+#include <memory_resource>
+#include <string>
 #include <vector>
 
+// Reads destuffed entropy coded data (see ReadEntropySegment), so bytes need
+// no checks for 0xff.
 class BitReader {
 private:
-    std::istream &input_;
+    const uint8_t *data_;
+    size_t size_;
+    size_t pos_ = 0;
     uint8_t buf_ = 0;
     uint8_t cur_pos_ = 8;
-    bool is_cur_byte_ff_ = false;
 
 public:
-    BitReader(std::istream &input);
+    BitReader(const uint8_t *data, size_t size);
 
     bool ReadBit();
 };
 
+// Entropy coded data of a scan with stuffed 0x00 bytes and RSTn markers
+// removed.
+struct EntropySegment {
+    std::pmr::vector<uint8_t> data;
+    // Offsets in |data| where the restart intervals after RSTn markers begin.
+    std::pmr::vector<size_t> restarts;
+    // Bytes of the input up to the marker which ends the segment.
+    size_t size = 0;
+};
+
+// Reads the entropy coded data after SOS header in one pass and leaves |input|
+// at the marker which ends it. Seekable streams are read by blocks searched
+// for 0xff with the CPU kernels and then sought back to the marker, others are
+// read byte by byte. At most |expected_size| bytes are reserved up front, e.g.
+// the samples of the scan, so data after the image doesn't take memory.
+EntropySegment ReadEntropySegment(
+    std::istream &input, size_t expected_size,
+    std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
 struct QT {
     uint8_t id;
     std::vector<uint16_t> table;
@@ -60,29 +87,193 @@ TwoBytes Read2Bytes(std::istream &input);
 
 std::string ReadCOM(std::istream &input);
 
-void ReadAPPn(std::istream &input);
+// Returns the payload of APPn segment (without marker and size).
+std::string ReadAPPn(std::istream &input);
 
 uint8_t CheckID(uint8_t id);
 
 void ReadDQT(std::istream &input, std::vector<QT> &qts);
 
+uint8_t ReadSOF(std::istream &input, std::map<uint8_t, Channel> &channels, uint16_t &width,
+                uint16_t &height, std::vector<QT> &qts);
+
 uint8_t ReadSOF(std::istream &input, std::map<uint8_t, Channel> &channels, Image &image,
                 std::vector<QT> &qts);
 
 void ReadDHT(std::istream &input, std::map<uint8_t, HuffmanTable> &hts);
 
-void DecodeZigZag(std::vector<double> &&input, std::vector<double> &output);
+void DecodeZigZag(const std::pmr::vector<double> &input, std::pmr::vector<double> &output);
 
-void ReadCoefs(BitReader &br, std::vector<HuffmanTree> &trees, std::vector<uint16_t> &table,
-               uint8_t channel);
+// Returns the number of coefficients up to EOB, 64 if the block has no EOB.
+size_t ReadCoefs(BitReader &br, std::vector<HuffmanTree> &trees, std::pmr::vector<uint16_t> &table,
+                 uint8_t channel);
 
-std::vector<double> QTDevide(std::vector<uint16_t> &table, std::vector<uint16_t> &qt);
+void QTDevide(const std::pmr::vector<uint16_t> &table, const std::vector<uint16_t> &qt,
+              std::pmr::vector<double> &output);
 
-void Norm(std::vector<double> &table, std::vector<int16_t> &norm_table);
+void Norm(const std::pmr::vector<double> &table, std::pmr::vector<int16_t> &norm_table);
 
 void YCbCrToRGB(int16_t y, int16_t cb, int16_t cr, Image &image, int i, int j);
 
+// Reads SOS header up to the entropy coded data, builds DC and AC trees of
+// every component and returns component ids in the scan order.
+std::vector<uint8_t> ReadSOSHeader(std::istream &input, std::map<uint8_t, Channel> &channels,
+                                   std::map<uint8_t, HuffmanTable> &hts,
+                                   std::vector<HuffmanTree> &trees);
+
+// Where the time of Decode goes. Filled only when the library is built with
+// JPEG_DECODE_STATS, otherwise the instrumentation isn't compiled in and the
+// stats stay zero.
+struct DecodeStats {
+    // Segments before the entropy coded data, including SOS header.
+    std::chrono::steady_clock::duration markers = std::chrono::steady_clock::duration::zero();
+    // Reading the entropy coded segment into memory (ReadEntropySegment).
+    std::chrono::steady_clock::duration prescan = std::chrono::steady_clock::duration::zero();
+    // Huffman decoding of the coefficients (ReadCoefs).
+    std::chrono::steady_clock::duration entropy = std::chrono::steady_clock::duration::zero();
+    // Dequantization, zigzag, IDCT and normalization.
+    std::chrono::steady_clock::duration idct = std::chrono::steady_clock::duration::zero();
+    // Upsampling, YCbCr->RGB and writing of the pixels.
+    std::chrono::steady_clock::duration color = std::chrono::steady_clock::duration::zero();
+    // Zero if the input stream doesn't report its position.
+    size_t bytes = 0;
+    size_t mcus = 0;
+    size_t blocks = 0;
+    // Blocks which ended with EOB before the last coefficient.
+    size_t eob_blocks = 0;
+    size_t stuffed_bytes = 0;
+    // Allocations of the working memory, pixels of the image aren't counted.
+    size_t allocations = 0;
+};
+
+struct DecodeOptions {
+    // Zero means no time limit.
+    std::chrono::steady_clock::duration time_budget = std::chrono::steady_clock::duration::zero();
+    // Decode stops as soon as it becomes true.
+    const std::atomic<bool> *cancelled = nullptr;
+    // Keep the rows decoded before the stop instead of returning an empty image.
+    bool allow_partial = false;
+    // Working memory of the decoder, the default resource if nullptr. Pixels
+    // are allocated by Image itself.
+    std::pmr::memory_resource *memory_resource = nullptr;
+    // Zero means no limit. Checked against EstimatePeakMemory with the bytes of
+    // the output before any allocation and enforced for the working memory
+    // during decode.
+    size_t memory_limit = 0;
+    // Stages and counters are added to it if not nullptr, see DecodeStats.
+    DecodeStats *stats = nullptr;
+};
+
+enum class DecodeStatus {
+    kOk,
+    kCancelled,
+    kDeadlineExceeded,
+};
+
+struct DecodeResult {
+    DecodeStatus status = DecodeStatus::kOk;
+    Image image;
+    // Number of the top rows of |image| which are decoded.
+    size_t valid_rows = 0;
+};
+
+// Fails allocations when more than |limit| bytes would be in use.
+class LimitedMemoryResource : public std::pmr::memory_resource {
+private:
+    std::pmr::memory_resource *upstream_;
+    size_t limit_;
+    size_t used_ = 0;
+    size_t peak_ = 0;
+
+    void *do_allocate(size_t bytes, size_t alignment) override;
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+
+public:
+    LimitedMemoryResource(std::pmr::memory_resource *upstream, size_t limit);
+
+    size_t Peak() const;
+};
+
+// Upper estimate of the peak memory of a decode of the image described by SOF:
+// |output_bytes| of the output (pixels of Image, none for a tensor of the
+// caller) plus buffers, trees and the entropy coded data.
+size_t EstimatePeakMemory(uint16_t width, uint16_t height,
+                          const std::map<uint8_t, Channel> &channels, size_t output_bytes);
+
+// Checks the limits of DecodeOptions, the time budget starts at construction.
+class DecodeGuard {
+private:
+    std::chrono::steady_clock::time_point deadline_;
+    bool has_deadline_ = false;
+    const std::atomic<bool> *cancelled_ = nullptr;
+
+public:
+    DecodeGuard() = default;
+
+    DecodeGuard(const DecodeOptions &options);
+
+    DecodeStatus Check() const;
+};
+
+// Gets Y, Cb and Cr samples of |width| pixels of the output row |row|.
+using SampleRowSink = std::function<void(size_t row, const int16_t *y, const int16_t *cb,
+                                         const int16_t *cr, size_t width)>;
+
+// Decodes the scan of |image_width| x |image_height| image downscaled by
+// |scale| (1, 2, 4 or 8) with the reduced IDCT and passes the samples to |sink|
+// row by row instead of writing an Image. |valid_rows| counts output rows.
+DecodeStatus ReadSOSSamples(std::istream &input, std::map<uint8_t, Channel> &channels,
+                            std::map<uint8_t, HuffmanTable> &hts, std::vector<QT> &qts,
+                            uint16_t image_width, uint16_t image_height, size_t scale,
+                            const SampleRowSink &sink, const DecodeGuard &guard,
+                            std::pmr::memory_resource *resource, size_t &valid_rows,
+                            DecodeStats *stats = nullptr);
+
+// Checks |guard| before every MCU row and stops if it isn't kOk. Number of the
+// decoded image rows is written to |valid_rows|. Working memory comes from
+// |resource|. Stages and counters are added to |stats| if it isn't nullptr.
+DecodeStatus ReadSOS(std::istream &input, std::map<uint8_t, Channel> &channels,
+                     std::map<uint8_t, HuffmanTable> &hts, Image &image, std::vector<QT> &qts,
+                     const DecodeGuard &guard, std::pmr::memory_resource *resource,
+                     size_t &valid_rows, DecodeStats *stats = nullptr);
+
 void ReadSOS(std::istream &input, std::map<uint8_t, Channel> &channels,
              std::map<uint8_t, HuffmanTable> &hts, Image &image, std::vector<QT> &qts);
 
+// Output of DecodeSamples, set up once SOF gives the image size.
+struct SampleTarget {
+    // Bytes the output of |width| x |height| image takes, they count in
+    // DecodeOptions::memory_limit. Called before anything is allocated, may
+    // throw or change |scale|.
+    std::function<size_t(uint16_t width, uint16_t height)> bytes;
+    // Called after the memory check, returns the sink for the rows of the scan
+    // decoded with the reduced IDCT of |scale|. Buffers of the sink come from
+    // |resource|, which lives only as long as DecodeSamples, so the sink must
+    // own them.
+    std::function<SampleRowSink(uint16_t width, uint16_t height,
+                                std::pmr::memory_resource *resource)>
+        init;
+    size_t scale = 1;
+};
+
+// Marker loop of Decode for any output: applies |options| the same way and
+// reads the input up to EOI. The text of COM is written to |comment| if it
+// isn't nullptr.
+DecodeStatus DecodeSamples(std::istream &input, const DecodeOptions &options,
+                           SampleTarget &target, size_t &valid_rows,
+                           std::string *comment = nullptr);
+
 Image Decode(std::istream &input);
+
+DecodeResult Decode(std::istream &input, const DecodeOptions &options);
+
+// Gets the size from SOF and returns the scale of the decode, 1, 2, 4 or 8.
+using ScaleChooser = std::function<size_t(uint16_t width, uint16_t height)>;
+
+// Decode with the reduced IDCT, the image is the original one downscaled by
+// the scale from |choose_scale| and rounded up.
+DecodeResult DecodeScaled(std::istream &input, const DecodeOptions &options,
+                          const ScaleChooser &choose_scale);
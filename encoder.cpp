@@ -0,0 +1,203 @@
+#include "encoder.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+BitWriter::BitWriter(std::ostream &output) : output_(output) {
+}
+
+void BitWriter::WriteBits(uint32_t bits, uint8_t count) {
+    while (count) {
+        --count;
+        buf_ |= ((bits >> count) & 1) << (7 - cur_pos_);
+        if (++cur_pos_ == 8) {
+            output_.put(buf_);
+            if (buf_ == 0xff) {
+                output_.put(0x00);
+            }
+            buf_ = 0;
+            cur_pos_ = 0;
+        }
+    }
+}
+
+void BitWriter::Flush() {
+    if (cur_pos_) {
+        WriteBits(0x7f, 8 - cur_pos_);
+    }
+}
+
+void HuffmanEncoder::Build(const std::vector<size_t> &frequencies) {
+    if (frequencies.size() != 256) {
+        throw std::invalid_argument("Bad frequencies size");
+    }
+    // Symbol 256 is reserved, so no code consists of ones only.
+    std::vector<size_t> freq(frequencies);
+    freq.push_back(1);
+    std::vector<uint8_t> code_size(257, 0);
+    std::vector<int> others(257, -1);
+    while (true) {
+        int c1 = -1, c2 = -1;
+        for (int i = 0; i < 257; ++i) {
+            if (freq[i] && (c1 < 0 || freq[i] <= freq[c1])) {
+                c1 = i;
+            }
+        }
+        for (int i = 0; i < 257; ++i) {
+            if (freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2])) {
+                c2 = i;
+            }
+        }
+        if (c2 < 0) {
+            break;
+        }
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        ++code_size[c1];
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            ++code_size[c1];
+        }
+        others[c1] = c2;
+        ++code_size[c2];
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            ++code_size[c2];
+        }
+    }
+
+    std::vector<size_t> bits(33, 0);
+    for (size_t i = 0; i < 257; ++i) {
+        if (code_size[i]) {
+            ++bits[code_size[i]];
+        }
+    }
+    for (size_t i = 32; i > 16; --i) {
+        while (bits[i]) {
+            size_t j = i - 2;
+            while (!bits[j]) {
+                --j;
+            }
+            bits[i] -= 2;
+            ++bits[i - 1];
+            bits[j + 1] += 2;
+            --bits[j];
+        }
+    }
+    size_t last = 16;
+    while (last && !bits[last]) {
+        --last;
+    }
+    if (last) {
+        --bits[last];
+    }
+
+    values_.clear();
+    for (uint8_t size = 1; size <= 32; ++size) {
+        for (size_t i = 0; i < 256; ++i) {
+            if (code_size[i] == size) {
+                values_.push_back(i);
+            }
+        }
+    }
+    std::fill(sizes_.begin(), sizes_.end(), 0);
+    uint16_t code = 0;
+    size_t pos = 0;
+    for (uint8_t size = 1; size <= 16; ++size) {
+        code_lengths_[size - 1] = bits[size];
+        for (size_t i = 0; i < bits[size]; ++i) {
+            codes_[values_[pos]] = code++;
+            sizes_[values_[pos++]] = size;
+        }
+        code <<= 1;
+    }
+}
+
+const std::vector<uint8_t> &HuffmanEncoder::CodeLengths() const {
+    return code_lengths_;
+}
+
+const std::vector<uint8_t> &HuffmanEncoder::Values() const {
+    return values_;
+}
+
+void HuffmanEncoder::Write(BitWriter &bw, uint8_t symbol) const {
+    if (!sizes_[symbol]) {
+        throw std::invalid_argument("Symbol " + std::to_string(symbol) + " has no code");
+    }
+    bw.WriteBits(codes_[symbol], sizes_[symbol]);
+}
+
+void Write2Bytes(std::ostream &output, uint16_t value) {
+    output.put(value >> 8);
+    output.put(value & 0xff);
+}
+
+uint8_t ValueSize(int value) {
+    value = std::abs(value);
+    uint8_t size = 0;
+    while (value) {
+        value >>= 1;
+        ++size;
+    }
+    return size;
+}
+
+namespace {
+
+void WriteValue(BitWriter &bw, int value, uint8_t size) {
+    // Negative values are stored as ones' complement of the magnitude.
+    if (value < 0) {
+        value += (1 << size) - 1;
+    }
+    bw.WriteBits(value, size);
+}
+
+}  // namespace
+
+void CountCoefs(const int16_t *table, int16_t last_dc, std::vector<size_t> &dc_frequencies,
+                std::vector<size_t> &ac_frequencies) {
+    ++dc_frequencies[ValueSize(table[0] - last_dc)];
+    uint8_t zeros = 0;
+    for (size_t i = 1; i < 64; ++i) {
+        if (!table[i]) {
+            ++zeros;
+            continue;
+        }
+        for (; zeros > 15; zeros -= 16) {
+            ++ac_frequencies[0xf0];
+        }
+        ++ac_frequencies[zeros << 4 | ValueSize(table[i])];
+        zeros = 0;
+    }
+    if (zeros) {
+        ++ac_frequencies[0x00];
+    }
+}
+
+void WriteCoefs(BitWriter &bw, const int16_t *table, int16_t last_dc, const HuffmanEncoder &dc,
+                const HuffmanEncoder &ac) {
+    int dc_diff = table[0] - last_dc;
+    uint8_t dc_size = ValueSize(dc_diff);
+    dc.Write(bw, dc_size);
+    WriteValue(bw, dc_diff, dc_size);
+    uint8_t zeros = 0;
+    for (size_t i = 1; i < 64; ++i) {
+        if (!table[i]) {
+            ++zeros;
+            continue;
+        }
+        for (; zeros > 15; zeros -= 16) {
+            ac.Write(bw, 0xf0);
+        }
+        uint8_t size = ValueSize(table[i]);
+        ac.Write(bw, zeros << 4 | size);
+        WriteValue(bw, table[i], size);
+        zeros = 0;
+    }
+    if (zeros) {
+        ac.Write(bw, 0x00);
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+class BitWriter {
+private:
+    std::ostream &output_;
+    uint8_t buf_ = 0;
+    uint8_t cur_pos_ = 0;
+
+public:
+    BitWriter(std::ostream &output);
+
+    // Writes |count| lowest bits of |bits|, the most significant first. 0xff
+    // bytes are followed by stuffed 0x00.
+    void WriteBits(uint32_t bits, uint8_t count);
+
+    // Pads the last byte with ones.
+    void Flush();
+};
+
+// Huffman code for the entropy encoder built from symbol frequencies as in
+// JPEG Annex K.2, so no code is longer than 16 bits.
+class HuffmanEncoder {
+private:
+    std::vector<uint8_t> code_lengths_ = std::vector<uint8_t>(16);
+    std::vector<uint8_t> values_;
+    std::vector<uint16_t> codes_ = std::vector<uint16_t>(256);
+    std::vector<uint8_t> sizes_ = std::vector<uint8_t>(256);
+
+public:
+    // |frequencies| has 256 elements, symbols with zero frequency get no code.
+    void Build(const std::vector<size_t> &frequencies);
+
+    // Same layout as in DHT section.
+    const std::vector<uint8_t> &CodeLengths() const;
+
+    const std::vector<uint8_t> &Values() const;
+
+    void Write(BitWriter &bw, uint8_t symbol) const;
+};
+
+void Write2Bytes(std::ostream &output, uint16_t value);
+
+// Number of bits needed for |value| in the JPEG magnitude category coding.
+uint8_t ValueSize(int value);
+
+// Accumulates symbol frequencies of a block in the zigzag order.
+void CountCoefs(const int16_t *table, int16_t last_dc, std::vector<size_t> &dc_frequencies,
+                std::vector<size_t> &ac_frequencies);
+
+// Inverse of ReadCoefs: encodes a block in the zigzag order with DC predicted
+// from |last_dc|.
+void WriteCoefs(BitWriter &bw, const int16_t *table, int16_t last_dc, const HuffmanEncoder &dc,
+                const HuffmanEncoder &ac);
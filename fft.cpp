@@ -3,8 +3,10 @@
 #include <fftw3.h>
 #include <stdexcept>
 #include <cmath>
+#include <vector>
 
-DctCalculator::DctCalculator(size_t width, std::vector<double> *input, std::vector<double> *output)
+DctCalculator::DctCalculator(size_t width, std::pmr::vector<double> *input,
+                             std::pmr::vector<double> *output)
     : width_(width), input_(input), output_(output) {
     if (!input_ || !output_ || input_->size() != width_ * width_ ||
         output_->size() != width_ * width_) {
@@ -30,3 +32,48 @@ void DctCalculator::Inverse() {
 DctCalculator::~DctCalculator() {
     fftw_destroy_plan(plan_);
 }
+
+void InverseDctReduced(const std::pmr::vector<double> &input, size_t size,
+                       std::pmr::vector<double> &output) {
+    if (size != 1 && size != 2 && size != 4) {
+        throw std::invalid_argument("Bad reduced DCT size");
+    }
+    if (input.size() != 64 || output.size() != size * size) {
+        throw std::invalid_argument("Bad arguments");
+    }
+    // cosines[size][x * size + u] = c(u) / 2 * cos((2x + 1) u pi / (2 size)), the
+    // same normalization as 8x8 IDCT.
+    static const std::vector<std::vector<double>> cosines = [] {
+        std::vector<std::vector<double>> result(5);
+        for (size_t n : {1, 2, 4}) {
+            result[n].resize(n * n);
+            for (size_t x = 0; x < n; ++x) {
+                for (size_t u = 0; u < n; ++u) {
+                    double c = u ? 0.5 : 0.5 / sqrt(2);
+                    result[n][x * n + u] = c * cos((2 * x + 1) * u * M_PI / (2 * n));
+                }
+            }
+        }
+        return result;
+    }();
+    const std::vector<double> &table = cosines[size];
+    double rows[16];
+    for (size_t v = 0; v < size; ++v) {
+        for (size_t x = 0; x < size; ++x) {
+            double sum = 0;
+            for (size_t u = 0; u < size; ++u) {
+                sum += input[v * 8 + u] * table[x * size + u];
+            }
+            rows[v * size + x] = sum;
+        }
+    }
+    for (size_t y = 0; y < size; ++y) {
+        for (size_t x = 0; x < size; ++x) {
+            double sum = 0;
+            for (size_t v = 0; v < size; ++v) {
+                sum += rows[v * size + x] * table[y * size + v];
+            }
+            output[y * size + x] = sum;
+        }
+    }
+}
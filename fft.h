@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <memory_resource>
 #include <vector>
 #include <fftw3.h>
 
@@ -9,13 +10,20 @@ private:
     fftw_plan plan_;
     size_t width_;
     size_t m_size_ = 8;
-    std::vector<double> *input_;
-    std::vector<double> *output_;
+    std::pmr::vector<double> *input_;
+    std::pmr::vector<double> *output_;
 
 public:
-    DctCalculator(size_t width, std::vector<double> *input, std::vector<double> *output);
+    DctCalculator(size_t width, std::pmr::vector<double> *input,
+                  std::pmr::vector<double> *output);
 
     void Inverse();
 
     ~DctCalculator();
 };
+
+// Inverse DCT of the top left |size| x |size| coefficients of 8x8 |input|, so
+// |output| gets |size| x |size| samples of the block downscaled by 8 / |size|
+// (1, 2 or 4). Coefficients and samples are in the natural order.
+void InverseDctReduced(const std::pmr::vector<double> &input, size_t size,
+                       std::pmr::vector<double> &output);
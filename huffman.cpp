@@ -1,6 +1,9 @@
 #include "huffman.h"
 #include <iostream>
 
+HuffmanTree::HuffmanTree(std::pmr::memory_resource *resource) : nodes_(resource) {
+}
+
 size_t HuffmanTree::DfsBuild(std::vector<uint8_t> &code_lengths, const std::vector<uint8_t> &values,
                              size_t cur_pos, size_t cur_stage) {
     if (cur_stage && code_lengths[cur_stage - 1]) {
@@ -8,20 +11,26 @@ size_t HuffmanTree::DfsBuild(std::vector<uint8_t> &code_lengths, const std::vect
         if (cur_pos >= values.size()) {
             throw std::invalid_argument("not enough values");
         }
-        cur_node_->value = values[cur_pos++];
-        cur_node_->is_node_terminated = true;
+        nodes_[cur_node_].value = values[cur_pos++];
+        nodes_[cur_node_].is_node_terminated = true;
         return cur_pos;
     }
-    if (cur_stage >= code_lengths.size()) {
+    // Nothing is left to place, so the subtree would stay empty.
+    if (cur_stage >= code_lengths.size() || cur_pos == values.size()) {
         return cur_pos;
     }
     auto tmp = cur_node_;
-    cur_node_->left = std::make_unique<Node>();
-    cur_node_ = cur_node_->left.get();
+    nodes_[tmp].left = nodes_.size();
+    nodes_.emplace_back();
+    cur_node_ = nodes_[tmp].left;
     cur_pos = DfsBuild(code_lengths, values, cur_pos, cur_stage + 1);
-    cur_node_ = tmp;
-    cur_node_->right = std::make_unique<Node>();
-    cur_node_ = cur_node_->right.get();
+    if (cur_pos == values.size()) {
+        cur_node_ = tmp;
+        return cur_pos;
+    }
+    nodes_[tmp].right = nodes_.size();
+    nodes_.emplace_back();
+    cur_node_ = nodes_[tmp].right;
     cur_pos = DfsBuild(code_lengths, values, cur_pos, cur_stage + 1);
     cur_node_ = tmp;
     return cur_pos;
@@ -32,14 +41,26 @@ void HuffmanTree::Build(const std::vector<uint8_t> &code_lengths,
     if (code_lengths.size() > 16) {
         throw std::invalid_argument("Huffman too big");
     }
+    nodes_.clear();
+    cur_node_ = -1;
     if (code_lengths.empty()) {
-        root_.reset(nullptr);
-        cur_node_ = nullptr;
         return;
     }
-    root_ = std::make_unique<Node>();
-    cur_node_ = root_.get();
+    // Levels below the longest code have no values, so they aren't built.
     std::vector<uint8_t> copy = code_lengths;
+    while (!copy.empty() && !copy.back()) {
+        copy.pop_back();
+    }
+    size_t count = 0;
+    for (uint8_t length : copy) {
+        count += length;
+    }
+    if (count > values.size()) {
+        throw std::invalid_argument("not enough values");
+    }
+    nodes_.reserve(2 * values.size() + copy.size() + 1);
+    nodes_.emplace_back();
+    cur_node_ = 0;
     size_t cur_pos = DfsBuild(copy, values);
     if (cur_pos != values.size()) {
         throw std::invalid_argument("not enough size");
@@ -47,29 +68,22 @@ void HuffmanTree::Build(const std::vector<uint8_t> &code_lengths,
 }
 
 bool HuffmanTree::Move(bool bit, int &value) {
-    if (!cur_node_) {
+    if (cur_node_ < 0) {
         throw std::invalid_argument("tree is empty");
     }
-    if (bit) {
-        if (!cur_node_->right) {
-            throw std::invalid_argument("Bad move");
-        }
-        cur_node_ = cur_node_->right.get();
-        if (cur_node_->is_node_terminated) {
-            value = cur_node_->value;
-            cur_node_ = root_.get();
-            return true;
-        }
-        return false;
-    }
-    if (!cur_node_->left) {
+    int32_t next = bit ? nodes_[cur_node_].right : nodes_[cur_node_].left;
+    if (next < 0) {
         throw std::invalid_argument("Bad move");
     }
-    cur_node_ = cur_node_->left.get();
-    if (cur_node_->is_node_terminated) {
-        value = cur_node_->value;
-        cur_node_ = root_.get();
+    if (nodes_[next].is_node_terminated) {
+        value = nodes_[next].value;
+        cur_node_ = 0;
         return true;
     }
+    cur_node_ = next;
     return false;
 }
+
+size_t HuffmanTree::EstimateBytes() {
+    return (2 * 256 + 16 + 1) * sizeof(Node);
+}
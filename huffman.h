@@ -3,23 +3,25 @@
 #include <vector>
 #include <cstddef>
 #include <cstdint>
-#include <memory>
+#include <memory_resource>
 
 // HuffmanTree decoder for DHT section.
 class HuffmanTree {
 private:
     struct Node {
-        std::unique_ptr<Node> left = nullptr;
-        std::unique_ptr<Node> right = nullptr;
+        int32_t left = -1;
+        int32_t right = -1;
         bool is_node_terminated = false;
         uint8_t value;
     };
 
-    std::unique_ptr<Node> root_ = nullptr;
-    Node *cur_node_ = nullptr;
+    // Nodes are kept in one pool, children are indices in it. The root is the
+    // first node.
+    std::pmr::vector<Node> nodes_;
+    int32_t cur_node_ = -1;
 
 public:
-    HuffmanTree() = default;
+    explicit HuffmanTree(std::pmr::memory_resource *resource = std::pmr::get_default_resource());
 
     size_t DfsBuild(std::vector<uint8_t> &code_lengths, const std::vector<uint8_t> &values,
                     size_t cur_pos = 0, size_t cur_stage = 0);
@@ -34,4 +36,8 @@ public:
     // returns true and overwrites |value|. If it is intermediate, returns false
     // and value is unmodified.
     bool Move(bool bit, int &value);
+
+    // Upper bound of the memory taken by a tree: it has at most two nodes per
+    // value and one empty node per level.
+    static size_t EstimateBytes();
 };
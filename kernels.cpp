@@ -0,0 +1,446 @@
+#include "kernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JPEG_X86_KERNELS
+#endif
+
+// Every level must round exactly like the scalar code, so a compiler isn't
+// allowed to fuse multiplications and additions into FMA. Clang enables FMA
+// with the avx512f target, the pragma covers the rest of the file.
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+namespace {
+
+void NormScalar(const double *input, int16_t *output, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        double value = input[i] + 128;
+        output[i] = value <= 0 ? 0 : value >= 255 ? 255 : static_cast<int16_t>(value);
+    }
+}
+
+void PixelToRGB(int16_t y, int16_t cb, int16_t cr, int &r, int &g, int &b) {
+    double cb_shift = cb - 128;
+    double cr_shift = cr - 128;
+    r = std::clamp(static_cast<int>(std::round(y + 1.402 * cr_shift)), 0, 255);
+    g = std::clamp(static_cast<int>(std::round(y - 0.34414 * cb_shift - 0.71414 * cr_shift)), 0,
+                   255);
+    b = std::clamp(static_cast<int>(std::round(y + 1.772 * cb_shift)), 0, 255);
+}
+
+void YCbCrToRGBScalar(const int16_t *y, const int16_t *cb, const int16_t *cr, int *r, int *g,
+                      int *b, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        PixelToRGB(y[i], cb[i], cr[i], r[i], g[i], b[i]);
+    }
+}
+
+void YCbCrToFloatScalar(const int16_t *y, const int16_t *cb, const int16_t *cr,
+                        const float *scale, const float *offset, float *r, float *g, float *b,
+                        size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        int ri, gi, bi;
+        PixelToRGB(y[i], cb[i], cr[i], ri, gi, bi);
+        r[i] = static_cast<float>(ri) * scale[0] + offset[0];
+        g[i] = static_cast<float>(gi) * scale[1] + offset[1];
+        b[i] = static_cast<float>(bi) * scale[2] + offset[2];
+    }
+}
+
+size_t FindFFScalar(const uint8_t *data, size_t size) {
+    size_t i = 0;
+    while (i < size && data[i] != 0xff) {
+        ++i;
+    }
+    return i;
+}
+
+#ifdef JPEG_X86_KERNELS
+
+// Vector kernels repeat the scalar arithmetic operation by operation, so the
+// results are bit exact. Tails go to the scalar kernels.
+
+__attribute__((target("sse4.2"))) void NormSSE42(const double *input, int16_t *output,
+                                                 size_t size) {
+    const __m128d shift = _mm_set1_pd(128), low = _mm_set1_pd(0), high = _mm_set1_pd(255);
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        __m128d a = _mm_add_pd(_mm_loadu_pd(input + i), shift);
+        __m128d b = _mm_add_pd(_mm_loadu_pd(input + i + 2), shift);
+        a = _mm_min_pd(_mm_max_pd(a, low), high);
+        b = _mm_min_pd(_mm_max_pd(b, low), high);
+        __m128i values = _mm_unpacklo_epi64(_mm_cvttpd_epi32(a), _mm_cvttpd_epi32(b));
+        __m128i packed = _mm_packs_epi32(values, _mm_setzero_si128());
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(output + i), packed);
+    }
+    NormScalar(input + i, output + i, size - i);
+}
+
+__attribute__((target("sse4.2"))) __m128i Load2SSE42(const int16_t *p) {
+    int32_t values;
+    std::memcpy(&values, p, sizeof(values));
+    return _mm_cvtepi16_epi32(_mm_cvtsi32_si128(values));
+}
+
+__attribute__((target("sse4.2"))) __m128d RoundSSE42(__m128d x) {
+    const __m128d half = _mm_set1_pd(0.5), one = _mm_set1_pd(1);
+    const __m128d sign_mask = _mm_set1_pd(-0.0);
+    __m128d truncated = _mm_round_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    __m128d fraction = _mm_andnot_pd(sign_mask, _mm_sub_pd(x, truncated));
+    __m128d step = _mm_or_pd(one, _mm_and_pd(sign_mask, x));
+    return _mm_add_pd(truncated, _mm_and_pd(_mm_cmpge_pd(fraction, half), step));
+}
+
+__attribute__((target("sse4.2"))) __m128i ClampSSE42(__m128d x) {
+    x = _mm_min_pd(_mm_max_pd(x, _mm_set1_pd(0)), _mm_set1_pd(255));
+    return _mm_cvttpd_epi32(x);
+}
+
+// RGB of 2 pixels in the low lanes.
+__attribute__((target("sse4.2"))) void PixelsToRGBSSE42(const int16_t *y, const int16_t *cb,
+                                                        const int16_t *cr, __m128i &r, __m128i &g,
+                                                        __m128i &b) {
+    const __m128i shift = _mm_set1_epi32(128);
+    __m128d yd = _mm_cvtepi32_pd(Load2SSE42(y));
+    __m128d cbd = _mm_cvtepi32_pd(_mm_sub_epi32(Load2SSE42(cb), shift));
+    __m128d crd = _mm_cvtepi32_pd(_mm_sub_epi32(Load2SSE42(cr), shift));
+    __m128d rd = _mm_add_pd(yd, _mm_mul_pd(_mm_set1_pd(1.402), crd));
+    __m128d gd = _mm_sub_pd(_mm_sub_pd(yd, _mm_mul_pd(_mm_set1_pd(0.34414), cbd)),
+                            _mm_mul_pd(_mm_set1_pd(0.71414), crd));
+    __m128d bd = _mm_add_pd(yd, _mm_mul_pd(_mm_set1_pd(1.772), cbd));
+    r = ClampSSE42(RoundSSE42(rd));
+    g = ClampSSE42(RoundSSE42(gd));
+    b = ClampSSE42(RoundSSE42(bd));
+}
+
+__attribute__((target("sse4.2"))) void YCbCrToRGBSSE42(const int16_t *y, const int16_t *cb,
+                                                       const int16_t *cr, int *r, int *g, int *b,
+                                                       size_t size) {
+    size_t i = 0;
+    for (; i + 2 <= size; i += 2) {
+        __m128i ri, gi, bi;
+        PixelsToRGBSSE42(y + i, cb + i, cr + i, ri, gi, bi);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(r + i), ri);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(g + i), gi);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(b + i), bi);
+    }
+    YCbCrToRGBScalar(y + i, cb + i, cr + i, r + i, g + i, b + i, size - i);
+}
+
+__attribute__((target("sse4.2"))) void StoreFloat2SSE42(__m128i values, float scale,
+                                                        float offset, float *output) {
+    __m128 result = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(values), _mm_set1_ps(scale)),
+                               _mm_set1_ps(offset));
+    _mm_storel_pi(reinterpret_cast<__m64 *>(output), result);
+}
+
+__attribute__((target("sse4.2"))) void YCbCrToFloatSSE42(const int16_t *y, const int16_t *cb,
+                                                         const int16_t *cr, const float *scale,
+                                                         const float *offset, float *r, float *g,
+                                                         float *b, size_t size) {
+    size_t i = 0;
+    for (; i + 2 <= size; i += 2) {
+        __m128i ri, gi, bi;
+        PixelsToRGBSSE42(y + i, cb + i, cr + i, ri, gi, bi);
+        StoreFloat2SSE42(ri, scale[0], offset[0], r + i);
+        StoreFloat2SSE42(gi, scale[1], offset[1], g + i);
+        StoreFloat2SSE42(bi, scale[2], offset[2], b + i);
+    }
+    YCbCrToFloatScalar(y + i, cb + i, cr + i, scale, offset, r + i, g + i, b + i, size - i);
+}
+
+__attribute__((target("sse4.2"))) size_t FindFFSSE42(const uint8_t *data, size_t size) {
+    const __m128i ff = _mm_set1_epi8(-1);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, ff));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + FindFFScalar(data + i, size - i);
+}
+
+__attribute__((target("avx2"))) void NormAVX2(const double *input, int16_t *output, size_t size) {
+    const __m256d shift = _mm256_set1_pd(128), low = _mm256_set1_pd(0),
+                  high = _mm256_set1_pd(255);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m256d a = _mm256_add_pd(_mm256_loadu_pd(input + i), shift);
+        __m256d b = _mm256_add_pd(_mm256_loadu_pd(input + i + 4), shift);
+        a = _mm256_min_pd(_mm256_max_pd(a, low), high);
+        b = _mm256_min_pd(_mm256_max_pd(b, low), high);
+        __m128i packed = _mm_packs_epi32(_mm256_cvttpd_epi32(a), _mm256_cvttpd_epi32(b));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i), packed);
+    }
+    NormScalar(input + i, output + i, size - i);
+}
+
+__attribute__((target("avx2"))) __m128i Load4AVX2(const int16_t *p) {
+    return _mm_cvtepi16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p)));
+}
+
+__attribute__((target("avx2"))) __m256d RoundAVX2(__m256d x) {
+    const __m256d half = _mm256_set1_pd(0.5), one = _mm256_set1_pd(1);
+    const __m256d sign_mask = _mm256_set1_pd(-0.0);
+    __m256d truncated = _mm256_round_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    __m256d fraction = _mm256_andnot_pd(sign_mask, _mm256_sub_pd(x, truncated));
+    __m256d step = _mm256_or_pd(one, _mm256_and_pd(sign_mask, x));
+    return _mm256_add_pd(truncated,
+                         _mm256_and_pd(_mm256_cmp_pd(fraction, half, _CMP_GE_OQ), step));
+}
+
+__attribute__((target("avx2"))) __m128i ClampAVX2(__m256d x) {
+    x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(0)), _mm256_set1_pd(255));
+    return _mm256_cvttpd_epi32(x);
+}
+
+__attribute__((target("avx2"))) void PixelsToRGBAVX2(const int16_t *y, const int16_t *cb,
+                                                     const int16_t *cr, __m128i &r, __m128i &g,
+                                                     __m128i &b) {
+    const __m128i shift = _mm_set1_epi32(128);
+    __m256d yd = _mm256_cvtepi32_pd(Load4AVX2(y));
+    __m256d cbd = _mm256_cvtepi32_pd(_mm_sub_epi32(Load4AVX2(cb), shift));
+    __m256d crd = _mm256_cvtepi32_pd(_mm_sub_epi32(Load4AVX2(cr), shift));
+    __m256d rd = _mm256_add_pd(yd, _mm256_mul_pd(_mm256_set1_pd(1.402), crd));
+    __m256d gd = _mm256_sub_pd(_mm256_sub_pd(yd, _mm256_mul_pd(_mm256_set1_pd(0.34414), cbd)),
+                               _mm256_mul_pd(_mm256_set1_pd(0.71414), crd));
+    __m256d bd = _mm256_add_pd(yd, _mm256_mul_pd(_mm256_set1_pd(1.772), cbd));
+    r = ClampAVX2(RoundAVX2(rd));
+    g = ClampAVX2(RoundAVX2(gd));
+    b = ClampAVX2(RoundAVX2(bd));
+}
+
+__attribute__((target("avx2"))) void YCbCrToRGBAVX2(const int16_t *y, const int16_t *cb,
+                                                    const int16_t *cr, int *r, int *g, int *b,
+                                                    size_t size) {
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        __m128i ri, gi, bi;
+        PixelsToRGBAVX2(y + i, cb + i, cr + i, ri, gi, bi);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(r + i), ri);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(g + i), gi);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(b + i), bi);
+    }
+    YCbCrToRGBScalar(y + i, cb + i, cr + i, r + i, g + i, b + i, size - i);
+}
+
+__attribute__((target("avx2"))) void StoreFloat4AVX2(__m128i values, float scale, float offset,
+                                                     float *output) {
+    __m128 result = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(values), _mm_set1_ps(scale)),
+                               _mm_set1_ps(offset));
+    _mm_storeu_ps(output, result);
+}
+
+__attribute__((target("avx2"))) void YCbCrToFloatAVX2(const int16_t *y, const int16_t *cb,
+                                                      const int16_t *cr, const float *scale,
+                                                      const float *offset, float *r, float *g,
+                                                      float *b, size_t size) {
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        __m128i ri, gi, bi;
+        PixelsToRGBAVX2(y + i, cb + i, cr + i, ri, gi, bi);
+        StoreFloat4AVX2(ri, scale[0], offset[0], r + i);
+        StoreFloat4AVX2(gi, scale[1], offset[1], g + i);
+        StoreFloat4AVX2(bi, scale[2], offset[2], b + i);
+    }
+    YCbCrToFloatScalar(y + i, cb + i, cr + i, scale, offset, r + i, g + i, b + i, size - i);
+}
+
+__attribute__((target("avx2"))) size_t FindFFAVX2(const uint8_t *data, size_t size) {
+    const __m256i ff = _mm256_set1_epi8(-1);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, ff));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + FindFFScalar(data + i, size - i);
+}
+
+// GCC reports _mm512_undefined_* inside the intrinsics as uninitialized.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+__attribute__((target("avx512f"))) void NormAVX512(const double *input, int16_t *output,
+                                                   size_t size) {
+    const __m512d shift = _mm512_set1_pd(128), low = _mm512_set1_pd(0),
+                  high = _mm512_set1_pd(255);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m512d a = _mm512_add_pd(_mm512_loadu_pd(input + i), shift);
+        a = _mm512_min_pd(_mm512_max_pd(a, low), high);
+        __m256i values = _mm512_cvttpd_epi32(a);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i),
+                         _mm_packs_epi32(_mm256_castsi256_si128(values),
+                                         _mm256_extracti128_si256(values, 1)));
+    }
+    NormScalar(input + i, output + i, size - i);
+}
+
+__attribute__((target("avx512f"))) __m256i Load8AVX512(const int16_t *p) {
+    return _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+}
+
+__attribute__((target("avx512f"))) __m512d RoundAVX512(__m512d x) {
+    const __m512d half = _mm512_set1_pd(0.5), one = _mm512_set1_pd(1);
+    __m512d truncated = _mm512_roundscale_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    __m512d fraction = _mm512_abs_pd(_mm512_sub_pd(x, truncated));
+    __mmask8 away = _mm512_cmp_pd_mask(fraction, half, _CMP_GE_OQ);
+    __mmask8 negative = _mm512_cmp_pd_mask(x, _mm512_setzero_pd(), _CMP_LT_OQ);
+    truncated = _mm512_mask_add_pd(truncated, away & ~negative, truncated, one);
+    return _mm512_mask_sub_pd(truncated, away & negative, truncated, one);
+}
+
+__attribute__((target("avx512f"))) __m256i ClampAVX512(__m512d x) {
+    x = _mm512_min_pd(_mm512_max_pd(x, _mm512_set1_pd(0)), _mm512_set1_pd(255));
+    return _mm512_cvttpd_epi32(x);
+}
+
+__attribute__((target("avx512f"))) void PixelsToRGBAVX512(const int16_t *y, const int16_t *cb,
+                                                         const int16_t *cr, __m256i &r, __m256i &g,
+                                                         __m256i &b) {
+    const __m256i shift = _mm256_set1_epi32(128);
+    __m512d yd = _mm512_cvtepi32_pd(Load8AVX512(y));
+    __m512d cbd = _mm512_cvtepi32_pd(_mm256_sub_epi32(Load8AVX512(cb), shift));
+    __m512d crd = _mm512_cvtepi32_pd(_mm256_sub_epi32(Load8AVX512(cr), shift));
+    __m512d rd = _mm512_add_pd(yd, _mm512_mul_pd(_mm512_set1_pd(1.402), crd));
+    __m512d gd = _mm512_sub_pd(_mm512_sub_pd(yd, _mm512_mul_pd(_mm512_set1_pd(0.34414), cbd)),
+                               _mm512_mul_pd(_mm512_set1_pd(0.71414), crd));
+    __m512d bd = _mm512_add_pd(yd, _mm512_mul_pd(_mm512_set1_pd(1.772), cbd));
+    r = ClampAVX512(RoundAVX512(rd));
+    g = ClampAVX512(RoundAVX512(gd));
+    b = ClampAVX512(RoundAVX512(bd));
+}
+
+__attribute__((target("avx512f"))) void YCbCrToRGBAVX512(const int16_t *y, const int16_t *cb,
+                                                        const int16_t *cr, int *r, int *g, int *b,
+                                                        size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m256i ri, gi, bi;
+        PixelsToRGBAVX512(y + i, cb + i, cr + i, ri, gi, bi);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(r + i), ri);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(g + i), gi);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(b + i), bi);
+    }
+    YCbCrToRGBScalar(y + i, cb + i, cr + i, r + i, g + i, b + i, size - i);
+}
+
+__attribute__((target("avx512f"))) void StoreFloat8AVX512(__m256i values, float scale,
+                                                          float offset, float *output) {
+    __m256 result = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(values), _mm256_set1_ps(scale)),
+                                  _mm256_set1_ps(offset));
+    _mm256_storeu_ps(output, result);
+}
+
+__attribute__((target("avx512f"))) void YCbCrToFloatAVX512(const int16_t *y, const int16_t *cb,
+                                                          const int16_t *cr, const float *scale,
+                                                          const float *offset, float *r, float *g,
+                                                          float *b, size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m256i ri, gi, bi;
+        PixelsToRGBAVX512(y + i, cb + i, cr + i, ri, gi, bi);
+        StoreFloat8AVX512(ri, scale[0], offset[0], r + i);
+        StoreFloat8AVX512(gi, scale[1], offset[1], g + i);
+        StoreFloat8AVX512(bi, scale[2], offset[2], b + i);
+    }
+    YCbCrToFloatScalar(y + i, cb + i, cr + i, scale, offset, r + i, g + i, b + i, size - i);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+const Kernels kScalarKernels{NormScalar, YCbCrToRGBScalar, FindFFScalar, YCbCrToFloatScalar};
+
+#ifdef JPEG_X86_KERNELS
+const Kernels kSSE42Kernels{NormSSE42, YCbCrToRGBSSE42, FindFFSSE42, YCbCrToFloatSSE42};
+const Kernels kAVX2Kernels{NormAVX2, YCbCrToRGBAVX2, FindFFAVX2, YCbCrToFloatAVX2};
+// Byte compares need AVX-512BW on top of the detected AVX-512F, so the byte
+// search stays on AVX2.
+const Kernels kAVX512Kernels{NormAVX512, YCbCrToRGBAVX512, FindFFAVX2, YCbCrToFloatAVX512};
+#endif
+
+const Kernels *KernelsOf(CpuLevel level) {
+#ifdef JPEG_X86_KERNELS
+    switch (level) {
+        case CpuLevel::kSSE42:
+            return &kSSE42Kernels;
+        case CpuLevel::kAVX2:
+            return &kAVX2Kernels;
+        case CpuLevel::kAVX512:
+            return &kAVX512Kernels;
+        default:
+            break;
+    }
+#endif
+    return &kScalarKernels;
+}
+
+struct Dispatch {
+    std::atomic<CpuLevel> level;
+    std::atomic<const Kernels *> kernels;
+
+    Dispatch() : level(DetectCpuLevel()), kernels(KernelsOf(level)) {
+    }
+};
+
+Dispatch &GetDispatch() {
+    static Dispatch dispatch;
+    return dispatch;
+}
+
+}  // namespace
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+CpuLevel DetectCpuLevel() {
+#ifdef JPEG_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return CpuLevel::kAVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return CpuLevel::kAVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return CpuLevel::kSSE42;
+    }
+#endif
+    return CpuLevel::kScalar;
+}
+
+const Kernels &GetKernels() {
+    return *GetDispatch().kernels.load(std::memory_order_relaxed);
+}
+
+CpuLevel GetCpuLevel() {
+    return GetDispatch().level.load(std::memory_order_relaxed);
+}
+
+void SetCpuLevel(CpuLevel level) {
+    if (level > DetectCpuLevel()) {
+        throw std::invalid_argument("CPU doesn't support this level");
+    }
+    GetDispatch().level.store(level, std::memory_order_relaxed);
+    GetDispatch().kernels.store(KernelsOf(level), std::memory_order_relaxed);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+enum class CpuLevel {
+    kScalar,
+    kSSE42,
+    kAVX2,
+    kAVX512,
+};
+
+// Hot loops of the decoder. Every level produces exactly the same output as
+// the scalar one.
+struct Kernels {
+    // Adds 128 to IDCT output and clamps it to [0, 255].
+    void (*norm)(const double *input, int16_t *output, size_t size);
+
+    // Converts |size| pixels with the same rounding as std::round.
+    void (*ycbcr_to_rgb)(const int16_t *y, const int16_t *cb, const int16_t *cr, int *r, int *g,
+                         int *b, size_t size);
+
+    // Position of the first 0xff byte of |data|, |size| if there is none.
+    size_t (*find_ff)(const uint8_t *data, size_t size);
+
+    // Same conversion as ycbcr_to_rgb, then channel c becomes
+    // value * scale[c] + offset[c] in float.
+    void (*ycbcr_to_float)(const int16_t *y, const int16_t *cb, const int16_t *cr,
+                           const float *scale, const float *offset, float *r, float *g, float *b,
+                           size_t size);
+};
+
+// The best level supported by the CPU and OS.
+CpuLevel DetectCpuLevel();
+
+// Kernels of the current level. The level is detected on the first call.
+const Kernels &GetKernels();
+
+CpuLevel GetCpuLevel();
+
+// Forces |level| (for tests and benchmarks). Levels not supported by the CPU
+// are rejected. Not thread safe with running decodes.
+void SetCpuLevel(CpuLevel level);
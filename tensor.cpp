@@ -0,0 +1,115 @@
+#include "tensor.h"
+#include "kernels.h"
+
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+
+uint8_t ToUInt8(float value) {
+    return value <= 0 ? 0 : value >= 255 ? 255 : static_cast<uint8_t>(std::lround(value));
+}
+
+// Writes rows of samples to the tensor.
+class TensorWriter {
+private:
+    const TensorShape &shape_;
+    const TensorOptions &options_;
+    void *output_;
+    const Kernels &kernels_;
+    // Planes of one row, for the layouts the kernel can't write directly.
+    std::pmr::vector<float> row_;
+
+public:
+    TensorWriter(const TensorShape &shape, const TensorOptions &options, void *output,
+                 std::pmr::memory_resource *resource)
+        : shape_(shape), options_(options), output_(output), kernels_(GetKernels()),
+          row_(3 * shape.width, resource) {
+    }
+
+    void operator()(size_t row, const int16_t *y, const int16_t *cb, const int16_t *cr,
+                    size_t width) {
+        size_t plane = shape_.height * shape_.width;
+        size_t start = row * shape_.width;
+        bool planar = options_.layout == TensorLayout::kNCHW;
+        float *r = row_.data(), *g = r + width, *b = g + width;
+        if (planar && shape_.type == TensorType::kFloat32) {
+            r = static_cast<float *>(output_) + start;
+            g = r + plane;
+            b = g + plane;
+        }
+        kernels_.ycbcr_to_float(y, cb, cr, options_.scale.data(), options_.offset.data(), r, g, b,
+                                width);
+        if (planar && shape_.type == TensorType::kFloat32) {
+            return;
+        }
+        const float *channels[3] = {r, g, b};
+        if (shape_.type == TensorType::kFloat32) {
+            float *output = static_cast<float *>(output_) + 3 * start;
+            for (size_t j = 0; j < width; ++j) {
+                for (size_t c = 0; c < 3; ++c) {
+                    output[3 * j + c] = channels[c][j];
+                }
+            }
+        } else if (planar) {
+            uint8_t *output = static_cast<uint8_t *>(output_) + start;
+            for (size_t c = 0; c < 3; ++c) {
+                for (size_t j = 0; j < width; ++j) {
+                    output[c * plane + j] = ToUInt8(channels[c][j]);
+                }
+            }
+        } else {
+            uint8_t *output = static_cast<uint8_t *>(output_) + 3 * start;
+            for (size_t j = 0; j < width; ++j) {
+                for (size_t c = 0; c < 3; ++c) {
+                    output[3 * j + c] = ToUInt8(channels[c][j]);
+                }
+            }
+        }
+    }
+};
+
+}  // namespace
+
+size_t TensorShape::Bytes() const {
+    return channels * height * width * (type == TensorType::kFloat32 ? sizeof(float) : 1);
+}
+
+TensorShape GetTensorShape(uint16_t width, uint16_t height, const TensorOptions &options) {
+    size_t scale = options.scale_denom;
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+        throw std::invalid_argument("Bad scale");
+    }
+    if (!width || !height) {
+        throw std::invalid_argument("Bad image size");
+    }
+    return {3, (height - 1) / scale + 1, (width - 1) / scale + 1, options.type};
+}
+
+TensorShape DecodeToTensor(std::istream &input, void *output, size_t capacity,
+                           const TensorOptions &tensor_options) {
+    return DecodeToTensor(input, output, capacity, tensor_options, DecodeOptions()).shape;
+}
+
+TensorResult DecodeToTensor(std::istream &input, void *output, size_t capacity,
+                            const TensorOptions &tensor_options, const DecodeOptions &options) {
+    TensorResult result;
+    TensorShape &shape = result.shape;
+    SampleTarget target;
+    target.scale = tensor_options.scale_denom;
+    target.bytes = [&](uint16_t width, uint16_t height) -> size_t {
+        shape = GetTensorShape(width, height, tensor_options);
+        if (shape.Bytes() > capacity) {
+            throw std::invalid_argument("Tensor is too small");
+        }
+        return 0;
+    };
+    target.init = [&](uint16_t, uint16_t, std::pmr::memory_resource *resource) {
+        return SampleRowSink(TensorWriter(shape, tensor_options, output, resource));
+    };
+    result.status = DecodeSamples(input, options, target, result.valid_rows);
+    if (result.status != DecodeStatus::kOk && !options.allow_partial) {
+        result.valid_rows = 0;
+    }
+    return result;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "decoder.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+
+enum class TensorLayout {
+    kNCHW,
+    kNHWC,
+};
+
+enum class TensorType {
+    kFloat32,
+    kUInt8,
+};
+
+struct TensorOptions {
+    TensorLayout layout = TensorLayout::kNCHW;
+    TensorType type = TensorType::kFloat32;
+    // Channel c (R, G, B) of a pixel becomes value * scale[c] + offset[c], e.g.
+    // scale = 1 / (255 * std) and offset = -mean / std. uint8 values are then
+    // rounded and saturated.
+    std::array<float, 3> scale = {1, 1, 1};
+    std::array<float, 3> offset = {0, 0, 0};
+    // The image is decoded downscaled by 1, 2, 4 or 8 with the reduced IDCT.
+    size_t scale_denom = 1;
+};
+
+// Shape of one image of the batch, image n starts at n * Bytes() of the tensor.
+struct TensorShape {
+    size_t channels = 3;
+    size_t height = 0;
+    size_t width = 0;
+    TensorType type = TensorType::kFloat32;
+
+    size_t Bytes() const;
+};
+
+struct TensorResult {
+    DecodeStatus status = DecodeStatus::kOk;
+    TensorShape shape;
+    // Number of the top rows of the tensor which are decoded, the others are
+    // unspecified.
+    size_t valid_rows = 0;
+};
+
+// Shape of the tensor for |width| x |height| image.
+TensorShape GetTensorShape(uint16_t width, uint16_t height, const TensorOptions &options);
+
+// Decodes the image straight into |output| of |capacity| bytes without making
+// an Image: color conversion and scale/offset are done in one pass per row.
+// Throws if the tensor doesn't fit into |capacity|.
+TensorShape DecodeToTensor(std::istream &input, void *output, size_t capacity,
+                           const TensorOptions &tensor_options);
+
+// The same with the limits and stats of |options| applied as by Decode. The
+// tensor is memory of the caller, so only the working memory counts in
+// memory_limit.
+TensorResult DecodeToTensor(std::istream &input, void *output, size_t capacity,
+                            const TensorOptions &tensor_options, const DecodeOptions &options);
@@ -0,0 +1,101 @@
+// Decoding with a memory limit and stats gives the same output as without
+// them, for Image, scaled and tensor outputs.
+#include "../bench/corpus.h"
+#include "../decoder.h"
+#include "../tensor.h"
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void Check(bool ok, const char *what) {
+    if (!ok) {
+        std::printf("FAIL %s\n", what);
+        ++failures;
+    }
+}
+
+std::vector<uint8_t> Pixels(const Image &image) {
+    std::vector<uint8_t> pixels;
+    for (size_t i = 0; i < image.Height(); ++i) {
+        for (size_t j = 0; j < image.Width(); ++j) {
+            RGB pixel = image.GetPixel(i, j);
+            pixels.push_back(pixel.r);
+            pixels.push_back(pixel.g);
+            pixels.push_back(pixel.b);
+        }
+    }
+    return pixels;
+}
+
+std::vector<uint8_t> DecodePixels(const std::string &jpeg, const DecodeOptions &options,
+                                  size_t scale) {
+    std::istringstream input(jpeg);
+    DecodeResult result =
+        DecodeScaled(input, options, [scale](uint16_t, uint16_t) { return scale; });
+    Check(result.status == DecodeStatus::kOk, "DecodeScaled status");
+    return Pixels(result.image);
+}
+
+std::vector<uint8_t> DecodeTensor(const std::string &jpeg, const DecodeOptions &options) {
+    TensorOptions tensor_options;
+    tensor_options.type = TensorType::kUInt8;
+    std::vector<uint8_t> tensor(3 * 640 * 480);
+    std::istringstream input(jpeg);
+    TensorResult result =
+        DecodeToTensor(input, tensor.data(), tensor.size(), tensor_options, options);
+    Check(result.status == DecodeStatus::kOk && result.valid_rows == 480, "DecodeToTensor");
+    return tensor;
+}
+
+}  // namespace
+
+int main() {
+    std::string jpeg = GenerateJpeg({640, 480, 75, Subsampling::k420});
+    std::istringstream input(jpeg);
+    std::vector<uint8_t> expected = Pixels(Decode(input));
+    std::vector<uint8_t> expected_scaled = DecodePixels(jpeg, DecodeOptions(), 4);
+    std::vector<uint8_t> expected_tensor = DecodeTensor(jpeg, DecodeOptions());
+
+    for (bool limit : {false, true}) {
+        for (bool with_stats : {false, true}) {
+            DecodeStats stats;
+            DecodeOptions options;
+            if (limit) {
+                options.memory_limit = 8 << 20;
+            }
+            if (with_stats) {
+                options.stats = &stats;
+            }
+            Check(DecodePixels(jpeg, options, 1) == expected, "Decode");
+            Check(DecodePixels(jpeg, options, 4) == expected_scaled, "DecodeScaled");
+            Check(DecodeTensor(jpeg, options) == expected_tensor, "DecodeToTensor output");
+#ifdef JPEG_DECODE_STATS
+            if (with_stats) {
+                Check(stats.mcus == 3 * 1200 && stats.allocations > 0, "stats");
+            }
+#endif
+        }
+    }
+
+    DecodeOptions options;
+    options.memory_limit = 100000;
+    try {
+        std::istringstream small(jpeg);
+        Decode(small, options);
+        Check(false, "memory limit");
+    } catch (const std::invalid_argument &) {
+    }
+
+    if (failures) {
+        std::printf("%d failures\n", failures);
+        return 1;
+    }
+    std::printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,182 @@
+// Every CPU level supported by the machine must give exactly the output of the
+// scalar kernels, including the tails shorter than the vector width.
+#include "../bench/corpus.h"
+#include "../decoder.h"
+#include "../kernels.h"
+#include "../tensor.h"
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void Check(bool ok, const char *what, CpuLevel level, size_t size) {
+    if (!ok) {
+        std::printf("FAIL %s: level %d, size %zu\n", what, static_cast<int>(level), size);
+        ++failures;
+    }
+}
+
+// Lengths around every vector width (4, 8, 16, 32 and 64 elements).
+std::vector<size_t> Sizes() {
+    std::vector<size_t> sizes;
+    for (size_t size = 0; size <= 70; ++size) {
+        sizes.push_back(size);
+    }
+    for (size_t size : {127, 128, 129, 1000, 1921}) {
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
+uint32_t Next(uint32_t &state) {
+    state = state * 1664525 + 1013904223;
+    return state >> 8;
+}
+
+void TestNorm(CpuLevel level) {
+    for (size_t size : Sizes()) {
+        std::vector<double> input(size);
+        uint32_t state = size + 1;
+        for (size_t i = 0; i < size; ++i) {
+            // Values past the clamping range and halves for the rounding.
+            input[i] = static_cast<int>(Next(state) % 1200) / 2.0 - 300;
+        }
+        if (size > 3) {
+            input[0] = -128.5;
+            input[1] = 127.5;
+            input[2] = 1e9;
+            input[3] = -1e9;
+        }
+        std::vector<int16_t> expected(size), actual(size);
+        SetCpuLevel(CpuLevel::kScalar);
+        GetKernels().norm(input.data(), expected.data(), size);
+        SetCpuLevel(level);
+        GetKernels().norm(input.data(), actual.data(), size);
+        Check(actual == expected, "norm", level, size);
+    }
+}
+
+void TestColor(CpuLevel level) {
+    const float scale[] = {1 / 58.4f, 1 / 57.1f, 1 / 57.4f};
+    const float offset[] = {-2.12f, -2.04f, -1.80f};
+    for (size_t size : Sizes()) {
+        std::vector<int16_t> y(size), cb(size), cr(size);
+        uint32_t state = size + 7;
+        for (size_t i = 0; i < size; ++i) {
+            y[i] = Next(state) % 256;
+            cb[i] = Next(state) % 256;
+            cr[i] = Next(state) % 256;
+        }
+        std::vector<int> r0(size), g0(size), b0(size), r(size), g(size), b(size);
+        SetCpuLevel(CpuLevel::kScalar);
+        GetKernels().ycbcr_to_rgb(y.data(), cb.data(), cr.data(), r0.data(), g0.data(), b0.data(),
+                                  size);
+        SetCpuLevel(level);
+        GetKernels().ycbcr_to_rgb(y.data(), cb.data(), cr.data(), r.data(), g.data(), b.data(),
+                                  size);
+        Check(r == r0 && g == g0 && b == b0, "ycbcr_to_rgb", level, size);
+
+        std::vector<float> fr0(size), fg0(size), fb0(size), fr(size), fg(size), fb(size);
+        SetCpuLevel(CpuLevel::kScalar);
+        GetKernels().ycbcr_to_float(y.data(), cb.data(), cr.data(), scale, offset, fr0.data(),
+                                    fg0.data(), fb0.data(), size);
+        SetCpuLevel(level);
+        GetKernels().ycbcr_to_float(y.data(), cb.data(), cr.data(), scale, offset, fr.data(),
+                                    fg.data(), fb.data(), size);
+        Check(fr == fr0 && fg == fg0 && fb == fb0, "ycbcr_to_float", level, size);
+    }
+}
+
+void TestFindFF(CpuLevel level) {
+    for (size_t size : Sizes()) {
+        // No 0xff at all, then a single one at every position.
+        for (size_t pos = 0; pos <= size; ++pos) {
+            std::vector<uint8_t> data(size, 0xfe);
+            if (pos < size) {
+                data[pos] = 0xff;
+            }
+            SetCpuLevel(CpuLevel::kScalar);
+            size_t expected = GetKernels().find_ff(data.data(), size);
+            SetCpuLevel(level);
+            Check(GetKernels().find_ff(data.data(), size) == expected, "find_ff", level, size);
+        }
+    }
+}
+
+std::vector<uint8_t> DecodePixels(const std::string &jpeg) {
+    std::istringstream input(jpeg);
+    Image image = Decode(input);
+    std::vector<uint8_t> pixels;
+    for (size_t i = 0; i < image.Height(); ++i) {
+        for (size_t j = 0; j < image.Width(); ++j) {
+            RGB pixel = image.GetPixel(i, j);
+            pixels.push_back(pixel.r);
+            pixels.push_back(pixel.g);
+            pixels.push_back(pixel.b);
+        }
+    }
+    return pixels;
+}
+
+std::vector<uint8_t> DecodeTensor(const std::string &jpeg, const TensorOptions &options) {
+    std::istringstream input(jpeg);
+    std::vector<uint8_t> tensor(3 * 4 * 1024 * 1024);
+    TensorShape shape = DecodeToTensor(input, tensor.data(), tensor.size(), options);
+    tensor.resize(shape.Bytes());
+    return tensor;
+}
+
+void TestDecode(CpuLevel level) {
+    // Odd sizes so every row ends with a partial vector.
+    const CorpusSpec specs[] = {
+        {333, 251, 90, Subsampling::k444, 3},
+        {161, 97, 75, Subsampling::k422, 4},
+        {203, 117, 50, Subsampling::k420, 5},
+    };
+    for (const CorpusSpec &spec : specs) {
+        std::string jpeg = GenerateJpeg(spec);
+        SetCpuLevel(CpuLevel::kScalar);
+        std::vector<uint8_t> expected = DecodePixels(jpeg);
+        SetCpuLevel(level);
+        Check(DecodePixels(jpeg) == expected, "Decode", level, spec.width);
+
+        TensorOptions options;
+        options.scale = {1 / 58.4f, 1 / 57.1f, 1 / 57.4f};
+        options.offset = {-2.12f, -2.04f, -1.80f};
+        for (size_t scale : {1, 2, 4, 8}) {
+            options.scale_denom = scale;
+            options.layout = scale == 2 ? TensorLayout::kNHWC : TensorLayout::kNCHW;
+            options.type = scale == 4 ? TensorType::kUInt8 : TensorType::kFloat32;
+            SetCpuLevel(CpuLevel::kScalar);
+            std::vector<uint8_t> expected_tensor = DecodeTensor(jpeg, options);
+            SetCpuLevel(level);
+            Check(DecodeTensor(jpeg, options) == expected_tensor, "DecodeToTensor", level,
+                  spec.width / scale);
+        }
+    }
+}
+
+}  // namespace
+
+int main() {
+    CpuLevel detected = DetectCpuLevel();
+    for (int i = 0; i <= static_cast<int>(detected); ++i) {
+        CpuLevel level = static_cast<CpuLevel>(i);
+        TestNorm(level);
+        TestColor(level);
+        TestFindFF(level);
+        TestDecode(level);
+    }
+    SetCpuLevel(detected);
+    if (failures) {
+        std::printf("%d failures\n", failures);
+        return 1;
+    }
+    std::printf("OK, checked levels up to %d\n", static_cast<int>(detected));
+    return 0;
+}
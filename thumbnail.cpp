@@ -0,0 +1,270 @@
+#include "thumbnail.h"
+#include "decoder.h"
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+class TiffReader {
+private:
+    const std::string &data_;
+    size_t start_;
+    bool little_endian_;
+
+public:
+    TiffReader(const std::string &data, size_t start, bool little_endian)
+        : data_(data), start_(start), little_endian_(little_endian) {
+    }
+
+    bool Has(size_t offset, size_t size) const {
+        return start_ + offset <= data_.size() && size <= data_.size() - start_ - offset;
+    }
+
+    uint16_t Get16(size_t offset) const {
+        uint16_t a = static_cast<uint8_t>(data_[start_ + offset]);
+        uint16_t b = static_cast<uint8_t>(data_[start_ + offset + 1]);
+        return little_endian_ ? (b << 8 | a) : (a << 8 | b);
+    }
+
+    uint32_t Get32(size_t offset) const {
+        uint32_t a = Get16(offset);
+        uint32_t b = Get16(offset + 2);
+        return little_endian_ ? (b << 16 | a) : (a << 16 | b);
+    }
+};
+
+bool StartsWith(const std::string &payload, const char *prefix, size_t size) {
+    return payload.size() >= size && payload.compare(0, size, prefix, size) == 0;
+}
+
+uint8_t Byte(const std::string &payload, size_t pos) {
+    return static_cast<uint8_t>(payload[pos]);
+}
+
+bool ReadRGBThumbnail(const std::string &payload, size_t pos, uint8_t width, uint8_t height,
+                      Image &image) {
+    if (payload.size() < pos + 3 * width * height) {
+        return false;
+    }
+    image.SetSize(width, height);
+    for (size_t i = 0; i < height; ++i) {
+        for (size_t j = 0; j < width; ++j, pos += 3) {
+            image.SetPixel(i, j, {Byte(payload, pos), Byte(payload, pos + 1),
+                                  Byte(payload, pos + 2)});
+        }
+    }
+    return true;
+}
+
+// Factor of the box filter of Downscale for |width| x |height| image.
+size_t DownscaleFactor(size_t width, size_t height, size_t max_size) {
+    return (std::max(width, height) - 1) / max_size + 1;
+}
+
+// Scale of the reduced IDCT for the downscale by |factor|. The box filter
+// does the rest, so its boxes must be whole or at least three pixels wide.
+size_t ThumbnailScale(size_t factor) {
+    for (size_t scale : {8, 4, 2}) {
+        if (factor % scale == 0 || factor >= 3 * scale) {
+            return scale;
+        }
+    }
+    return 1;
+}
+
+// Box filter to |width| x |height|, which aren't larger than the image. Boxes
+// are spread evenly, so the factor doesn't have to be an integer.
+Image BoxResize(const Image &image, size_t width, size_t height) {
+    Image result;
+    result.SetSize(width, height);
+    result.SetComment(image.GetComment());
+    for (size_t i = 0; i < height; ++i) {
+        size_t top = i * image.Height() / height, bottom = (i + 1) * image.Height() / height;
+        for (size_t j = 0; j < width; ++j) {
+            size_t left = j * image.Width() / width, right = (j + 1) * image.Width() / width;
+            int r = 0, g = 0, b = 0, count = 0;
+            for (size_t y = top; y < bottom; ++y) {
+                for (size_t x = left; x < right; ++x) {
+                    RGB pixel = image.GetPixel(y, x);
+                    r += pixel.r;
+                    g += pixel.g;
+                    b += pixel.b;
+                    ++count;
+                }
+            }
+            result.SetPixel(i, j, {r / count, g / count, b / count});
+        }
+    }
+    return result;
+}
+
+}  // namespace
+
+std::string ReadEXIFThumbnail(const std::string &payload) {
+    if (!StartsWith(payload, "Exif\0\0", 6) || payload.size() < 14) {
+        return {};
+    }
+    bool little_endian;
+    if (payload.compare(6, 2, "II") == 0) {
+        little_endian = true;
+    } else if (payload.compare(6, 2, "MM") == 0) {
+        little_endian = false;
+    } else {
+        return {};
+    }
+    TiffReader tiff(payload, 6, little_endian);
+    if (tiff.Get16(2) != 42) {
+        return {};
+    }
+    // IFD0 describes the main image, the thumbnail lives in the next one.
+    uint32_t ifd = tiff.Get32(4);
+    if (!tiff.Has(ifd, 2)) {
+        return {};
+    }
+    uint16_t count = tiff.Get16(ifd);
+    if (!tiff.Has(ifd + 2, 12 * count + 4)) {
+        return {};
+    }
+    ifd = tiff.Get32(ifd + 2 + 12 * count);
+    if (!ifd || !tiff.Has(ifd, 2)) {
+        return {};
+    }
+    count = tiff.Get16(ifd);
+    if (!tiff.Has(ifd + 2, 12 * count)) {
+        return {};
+    }
+    uint32_t offset = 0, length = 0;
+    for (uint16_t i = 0; i < count; ++i) {
+        size_t entry = ifd + 2 + 12 * i;
+        uint16_t tag = tiff.Get16(entry);
+        if (tag == 0x0201) {
+            offset = tiff.Get32(entry + 8);
+        } else if (tag == 0x0202) {
+            length = tiff.Get32(entry + 8);
+        }
+    }
+    if (!offset || !length || !tiff.Has(offset, length)) {
+        return {};
+    }
+    return payload.substr(6 + offset, length);
+}
+
+bool ReadJFIFThumbnail(const std::string &payload, Thumbnail &thumbnail) {
+    if (StartsWith(payload, "JFIF\0", 5)) {
+        if (payload.size() < 14 || !Byte(payload, 12) || !Byte(payload, 13)) {
+            return false;
+        }
+        return ReadRGBThumbnail(payload, 14, Byte(payload, 12), Byte(payload, 13),
+                                thumbnail.image);
+    }
+    if (!StartsWith(payload, "JFXX\0", 5) || payload.size() < 6) {
+        return false;
+    }
+    uint8_t extension = Byte(payload, 5);
+    if (extension == 0x10) {
+        // Empty JPEG is a truncated thumbnail.
+        if (payload.size() <= 6) {
+            return false;
+        }
+        thumbnail.jpeg = payload.substr(6);
+        return true;
+    }
+    if (payload.size() < 8 || !Byte(payload, 6) || !Byte(payload, 7)) {
+        return false;
+    }
+    uint8_t width = Byte(payload, 6), height = Byte(payload, 7);
+    if (extension == 0x13) {
+        return ReadRGBThumbnail(payload, 8, width, height, thumbnail.image);
+    }
+    if (extension != 0x11) {
+        return false;
+    }
+    // 256 entries RGB palette followed by one index per pixel.
+    size_t pos = 8 + 768;
+    if (payload.size() < pos + width * height) {
+        return false;
+    }
+    thumbnail.image.SetSize(width, height);
+    for (size_t i = 0; i < height; ++i) {
+        for (size_t j = 0; j < width; ++j) {
+            size_t color = 8 + 3 * Byte(payload, pos++);
+            thumbnail.image.SetPixel(i, j, {Byte(payload, color), Byte(payload, color + 1),
+                                            Byte(payload, color + 2)});
+        }
+    }
+    return true;
+}
+
+bool FindThumbnail(std::istream &input, Thumbnail &thumbnail) {
+    if (!Read2Bytes(input).IsSOI()) {
+        throw std::invalid_argument("First marker isn't SOI");
+    }
+    while (true) {
+        if (input.eof()) {
+            throw std::invalid_argument("This input hasn't EOI");
+        }
+        TwoBytes marker = Read2Bytes(input);
+        if (marker.IsSOS() || marker.IsEOI()) {
+            return false;
+        }
+        if (marker.first != 0xff) {
+            throw std::invalid_argument("Bad marker");
+        }
+        // Every segment before SOS has a size, so others are skipped the same way.
+        std::string payload = ReadAPPn(input);
+        if (!marker.IsAPPn()) {
+            continue;
+        }
+        thumbnail.jpeg = ReadEXIFThumbnail(payload);
+        if (!thumbnail.jpeg.empty() || ReadJFIFThumbnail(payload, thumbnail)) {
+            return true;
+        }
+    }
+}
+
+Image Downscale(const Image &image, size_t max_size) {
+    size_t factor = DownscaleFactor(image.Width(), image.Height(), max_size);
+    if (factor <= 1) {
+        return image;
+    }
+    return BoxResize(image, (image.Width() - 1) / factor + 1, (image.Height() - 1) / factor + 1);
+}
+
+Image ExtractThumbnail(std::istream &input, size_t max_size) {
+    if (!max_size) {
+        throw std::invalid_argument("Bad thumbnail size");
+    }
+    std::streampos start = input.tellg();
+    Thumbnail thumbnail;
+    if (FindThumbnail(input, thumbnail)) {
+        if (thumbnail.jpeg.empty()) {
+            return Downscale(thumbnail.image, max_size);
+        }
+        try {
+            std::istringstream jpeg(thumbnail.jpeg);
+            return Downscale(Decode(jpeg), max_size);
+        } catch (const std::invalid_argument &) {
+            // Unsupported thumbnail (e.g. progressive) isn't fatal, decode the main image.
+        }
+    }
+    if (start == std::streampos(-1)) {
+        throw std::invalid_argument("Input isn't seekable");
+    }
+    input.clear();
+    input.seekg(start);
+    // The reduced IDCT does a part of the downscale, the thumbnail keeps the
+    // size Downscale of the full image would give.
+    size_t factor = 1, width = 0, height = 0;
+    auto choose_scale = [&](uint16_t image_width, uint16_t image_height) -> size_t {
+        factor = DownscaleFactor(image_width, image_height, max_size);
+        width = (image_width - 1) / factor + 1;
+        height = (image_height - 1) / factor + 1;
+        return ThumbnailScale(factor);
+    };
+    Image image = DecodeScaled(input, DecodeOptions(), choose_scale).image;
+    if (factor <= 1) {
+        return image;
+    }
+    return BoxResize(image, width, height);
+}
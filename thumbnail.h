@@ -0,0 +1,36 @@
+#pragma once
+
+#include "utils/image.h"
+#include <cstddef>
+#include <istream>
+#include <string>
+
+// Preview embedded into APP0 (JFIF/JFXX) or APP1 (EXIF IFD1) segment.
+struct Thumbnail {
+    // Compressed thumbnail (EXIF, JFXX extension 0x10). Empty if the thumbnail
+    // is stored uncompressed, then it is already in |image|.
+    std::string jpeg;
+    Image image;
+};
+
+// Returns JPEG stream referenced by IFD1 of EXIF APP1 payload or empty string
+// if there is no such stream. Malformed EXIF is treated as no thumbnail.
+std::string ReadEXIFThumbnail(const std::string &payload);
+
+// Fills |thumbnail| from JFIF APP0 or JFXX extension payload. Returns false if
+// the payload doesn't carry a thumbnail, truncated one is treated the same.
+bool ReadJFIFThumbnail(const std::string &payload, Thumbnail &thumbnail);
+
+// Walks the markers before SOS and looks for an embedded thumbnail. Entropy
+// coded data is never read.
+bool FindThumbnail(std::istream &input, Thumbnail &thumbnail);
+
+// Box filter downscale by an integer factor so that the result fits into
+// |max_size| x |max_size|.
+Image Downscale(const Image &image, size_t max_size);
+
+// Returns the embedded thumbnail decoded and downscaled to |max_size|, or the
+// main image if there is none. The main image gets the size Downscale would
+// give, but most of the downscale is done by the reduced IDCT. |input| must be
+// seekable for the fallback.
+Image ExtractThumbnail(std::istream &input, size_t max_size = 160);
@@ -0,0 +1,345 @@
+#include "transcode.h"
+#include "encoder.h"
+#include "huffman.h"
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+const uint8_t kZigZag[64] = {0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+                             12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+                             35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+                             58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+namespace {
+
+size_t MaxThinning(const CoefImage &image, bool horizontal) {
+    size_t result = 1;
+    for (const auto &plane : image.planes) {
+        result = std::max<size_t>(result, horizontal ? plane.h_thinning : plane.v_thinning);
+    }
+    return result;
+}
+
+// Calls |f(component, block)| for every block in the order of the interleaved scan.
+template <class Image, class F>
+void ForEachBlock(Image &image, F f) {
+    size_t mcu_width = image.planes[0].width / image.planes[0].h_thinning;
+    size_t mcu_height = image.planes[0].height / image.planes[0].v_thinning;
+    for (size_t my = 0; my < mcu_height; ++my) {
+        for (size_t mx = 0; mx < mcu_width; ++mx) {
+            for (size_t c = 0; c < image.planes.size(); ++c) {
+                auto &plane = image.planes[c];
+                for (size_t by = 0; by < plane.v_thinning; ++by) {
+                    for (size_t bx = 0; bx < plane.h_thinning; ++bx) {
+                        size_t row = my * plane.v_thinning + by;
+                        size_t column = mx * plane.h_thinning + bx;
+                        f(c, &plane.coefs[(row * plane.width + column) * 64]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void ReadScan(std::istream &input, std::map<uint8_t, Channel> &channels,
+              std::map<uint8_t, HuffmanTable> &hts, CoefImage &image) {
+    std::vector<HuffmanTree> trees(6);
+    std::vector<uint8_t> component_channels = ReadSOSHeader(input, channels, hts, trees);
+    if (component_channels.size() != channels.size()) {
+        throw std::invalid_argument("Scan doesn't contain all channels(SOS)");
+    }
+    for (uint8_t id : component_channels) {
+        const Channel &channel = channels[id];
+        CoefPlane plane{id, static_cast<uint8_t>(channel.thinning >> 4),
+                        static_cast<uint8_t>(channel.thinning % 16), channel.qt_id, 0, 0, {}};
+        if (!plane.h_thinning || !plane.v_thinning) {
+            throw std::invalid_argument("Bad thinning(SOF)");
+        }
+        if (component_channels.size() == 1) {
+            // Single component scan isn't interleaved, MCU is one block.
+            plane.h_thinning = plane.v_thinning = 1;
+        }
+        image.planes.push_back(plane);
+    }
+    size_t mcu_width = (image.width - 1) / (8 * MaxThinning(image, true)) + 1;
+    size_t mcu_height = (image.height - 1) / (8 * MaxThinning(image, false)) + 1;
+    for (auto &plane : image.planes) {
+        plane.width = mcu_width * plane.h_thinning;
+        plane.height = mcu_height * plane.v_thinning;
+        plane.coefs.assign(plane.width * plane.height * 64, 0);
+    }
+
+    size_t samples = static_cast<size_t>(image.width) * image.height * channels.size();
+    EntropySegment segment = ReadEntropySegment(input, samples);
+    BitReader br(segment.data.data(), segment.data.size());
+    std::pmr::vector<uint16_t> table(64);
+    std::vector<uint16_t> last_dc(image.planes.size(), 0);
+    ForEachBlock(image, [&](size_t c, int16_t *block) {
+        std::fill(table.begin(), table.end(), 0);
+        ReadCoefs(br, trees, table, image.planes[c].id);
+        table[0] += last_dc[c];
+        last_dc[c] = table[0];
+        for (size_t i = 0; i < 64; ++i) {
+            block[kZigZag[i]] = static_cast<int16_t>(table[i]);
+        }
+    });
+}
+
+void WriteTable(std::ostream &output, uint8_t id, const HuffmanEncoder &encoder) {
+    output.put(0xff);
+    output.put(0xc4);
+    Write2Bytes(output, 2 + 1 + 16 + encoder.Values().size());
+    output.put(id);
+    for (uint8_t length : encoder.CodeLengths()) {
+        output.put(length);
+    }
+    for (uint8_t value : encoder.Values()) {
+        output.put(value);
+    }
+}
+
+}  // namespace
+
+CoefImage ReadCoefImage(std::istream &input) {
+    if (!Read2Bytes(input).IsSOI()) {
+        throw std::invalid_argument("First marker isn't SOI");
+    }
+    CoefImage image;
+    std::map<uint8_t, Channel> channels;
+    std::map<uint8_t, HuffmanTable> hts;
+    bool was_header = false;
+    bool was_dht = false;
+    while (true) {
+        if (input.eof()) {
+            throw std::invalid_argument("This input hasn't SOS");
+        }
+        TwoBytes marker = Read2Bytes(input);
+        if (marker.IsCOM()) {
+            image.comment = ReadCOM(input);
+        } else if (marker.IsAPPn()) {
+            ReadAPPn(input);
+        } else if (marker.IsDQT()) {
+            ReadDQT(input, image.qts);
+        } else if (marker.IsSOF()) {
+            if (was_header) {
+                throw std::invalid_argument("More than one header");
+            }
+            if (ReadSOF(input, channels, image.width, image.height, image.qts) != 8) {
+                throw std::invalid_argument("Precision isn't 8(SOF)");
+            }
+            was_header = true;
+        } else if (marker.IsDHT()) {
+            ReadDHT(input, hts);
+            was_dht = true;
+        } else if (marker.IsSOS()) {
+            if (!was_header || !was_dht || image.qts.empty()) {
+                throw std::invalid_argument("SOS without SOF/DQT/DHT");
+            }
+            ReadScan(input, channels, hts, image);
+            return image;
+        } else {
+            throw std::invalid_argument("Else");
+        }
+    }
+}
+
+void CropCoefs(CoefImage &image, const CropRegion &crop) {
+    size_t mcu_width = 8 * MaxThinning(image, true);
+    size_t mcu_height = 8 * MaxThinning(image, false);
+    if (crop.x % mcu_width || crop.y % mcu_height) {
+        throw std::invalid_argument("Crop isn't aligned to MCU");
+    }
+    if (crop.x >= image.width || crop.y >= image.height) {
+        throw std::invalid_argument("Crop is out of image");
+    }
+    size_t width = image.width - crop.x;
+    size_t height = image.height - crop.y;
+    if (crop.width) {
+        width = std::min(width, crop.width);
+    }
+    if (crop.height) {
+        height = std::min(height, crop.height);
+    }
+    for (auto &plane : image.planes) {
+        size_t x = crop.x / mcu_width * plane.h_thinning;
+        size_t y = crop.y / mcu_height * plane.v_thinning;
+        size_t plane_width = ((width - 1) / mcu_width + 1) * plane.h_thinning;
+        size_t plane_height = ((height - 1) / mcu_height + 1) * plane.v_thinning;
+        std::vector<int16_t> coefs(plane_width * plane_height * 64);
+        for (size_t i = 0; i < plane_height; ++i) {
+            auto row = plane.coefs.begin() + ((y + i) * plane.width + x) * 64;
+            std::copy(row, row + plane_width * 64, coefs.begin() + i * plane_width * 64);
+        }
+        plane.coefs = std::move(coefs);
+        plane.width = plane_width;
+        plane.height = plane_height;
+    }
+    image.width = width;
+    image.height = height;
+}
+
+void TransformCoefs(CoefImage &image, Transform transform) {
+    bool transpose = transform == Transform::kTranspose || transform == Transform::kRotate90 ||
+                     transform == Transform::kRotate270;
+    bool flip_h = transform == Transform::kFlipHorizontal || transform == Transform::kRotate90 ||
+                  transform == Transform::kRotate180;
+    bool flip_v = transform == Transform::kFlipVertical || transform == Transform::kRotate180 ||
+                  transform == Transform::kRotate270;
+    if (!transpose && !flip_h && !flip_v) {
+        return;
+    }
+
+    // Padding blocks of the mirrored axes can't become the first ones.
+    CropRegion trim;
+    size_t mcu_width = 8 * MaxThinning(image, true);
+    size_t mcu_height = 8 * MaxThinning(image, false);
+    if (transpose ? flip_v : flip_h) {
+        trim.width = image.width / mcu_width * mcu_width;
+    }
+    if (transpose ? flip_h : flip_v) {
+        trim.height = image.height / mcu_height * mcu_height;
+    }
+    if (((transpose ? flip_v : flip_h) && !trim.width) ||
+        ((transpose ? flip_h : flip_v) && !trim.height)) {
+        throw std::invalid_argument("Image is smaller than MCU");
+    }
+    CropCoefs(image, trim);
+
+    for (auto &plane : image.planes) {
+        size_t width = transpose ? plane.height : plane.width;
+        size_t height = transpose ? plane.width : plane.height;
+        std::vector<int16_t> coefs(plane.coefs.size());
+        for (size_t y = 0; y < height; ++y) {
+            for (size_t x = 0; x < width; ++x) {
+                size_t src_x = flip_h ? width - 1 - x : x;
+                size_t src_y = flip_v ? height - 1 - y : y;
+                if (transpose) {
+                    std::swap(src_x, src_y);
+                }
+                const int16_t *src = &plane.coefs[(src_y * plane.width + src_x) * 64];
+                int16_t *dst = &coefs[(y * width + x) * 64];
+                for (size_t u = 0; u < 8; ++u) {
+                    for (size_t v = 0; v < 8; ++v) {
+                        // Mirroring negates odd frequencies of the mirrored axis.
+                        bool negate = (flip_h && v % 2) != (flip_v && u % 2);
+                        int16_t value = transpose ? src[v * 8 + u] : src[u * 8 + v];
+                        dst[u * 8 + v] = negate ? -value : value;
+                    }
+                }
+            }
+        }
+        plane.coefs = std::move(coefs);
+        plane.width = width;
+        plane.height = height;
+        if (transpose) {
+            std::swap(plane.h_thinning, plane.v_thinning);
+        }
+    }
+    if (transpose) {
+        std::swap(image.width, image.height);
+        // Quantization step follows its coefficient.
+        for (auto &qt : image.qts) {
+            std::vector<uint16_t> natural(64);
+            for (size_t i = 0; i < 64; ++i) {
+                natural[kZigZag[i] % 8 * 8 + kZigZag[i] / 8] = qt.table[i];
+            }
+            for (size_t i = 0; i < 64; ++i) {
+                qt.table[i] = natural[kZigZag[i]];
+            }
+        }
+    }
+}
+
+void WriteCoefImage(const CoefImage &image, std::ostream &output) {
+    output.put(0xff);
+    output.put(0xd8);
+    if (!image.comment.empty()) {
+        output.put(0xff);
+        output.put(0xfe);
+        Write2Bytes(output, 2 + image.comment.size());
+        output.write(image.comment.data(), image.comment.size());
+    }
+    for (const auto &qt : image.qts) {
+        uint8_t bytes = CheckID(qt.id);
+        output.put(0xff);
+        output.put(0xdb);
+        Write2Bytes(output, 2 + 1 + 64 * bytes);
+        output.put(qt.id);
+        for (size_t i = 0; i < 64; ++i) {
+            if (bytes == 2) {
+                Write2Bytes(output, qt.table[i]);
+            } else {
+                output.put(qt.table[i]);
+            }
+        }
+    }
+
+    output.put(0xff);
+    output.put(0xc0);
+    Write2Bytes(output, 8 + 3 * image.planes.size());
+    output.put(8);
+    Write2Bytes(output, image.height);
+    Write2Bytes(output, image.width);
+    output.put(image.planes.size());
+    for (const auto &plane : image.planes) {
+        output.put(plane.id);
+        output.put(plane.h_thinning << 4 | plane.v_thinning);
+        output.put(image.qts[plane.qt_id].id % 16);
+    }
+
+    // Luma gets table 0, chroma components share table 1.
+    std::vector<std::vector<size_t>> dc_frequencies(2, std::vector<size_t>(256, 0));
+    std::vector<std::vector<size_t>> ac_frequencies(2, std::vector<size_t>(256, 0));
+    std::vector<int16_t> last_dc(image.planes.size(), 0);
+    std::vector<int16_t> table(64);
+    ForEachBlock(image, [&](size_t c, const int16_t *block) {
+        for (size_t i = 0; i < 64; ++i) {
+            table[i] = block[kZigZag[i]];
+        }
+        CountCoefs(table.data(), last_dc[c], dc_frequencies[c > 0], ac_frequencies[c > 0]);
+        last_dc[c] = table[0];
+    });
+    size_t tables_count = image.planes.size() > 1 ? 2 : 1;
+    std::vector<HuffmanEncoder> dc(tables_count), ac(tables_count);
+    for (size_t i = 0; i < tables_count; ++i) {
+        dc[i].Build(dc_frequencies[i]);
+        ac[i].Build(ac_frequencies[i]);
+        WriteTable(output, i, dc[i]);
+        WriteTable(output, 0x10 | i, ac[i]);
+    }
+
+    output.put(0xff);
+    output.put(0xda);
+    Write2Bytes(output, 6 + 2 * image.planes.size());
+    output.put(image.planes.size());
+    for (size_t c = 0; c < image.planes.size(); ++c) {
+        output.put(image.planes[c].id);
+        output.put(c > 0 ? 0x11 : 0x00);
+    }
+    output.put(0x00);
+    output.put(0x3f);
+    output.put(0x00);
+
+    BitWriter bw(output);
+    std::fill(last_dc.begin(), last_dc.end(), 0);
+    ForEachBlock(image, [&](size_t c, const int16_t *block) {
+        for (size_t i = 0; i < 64; ++i) {
+            table[i] = block[kZigZag[i]];
+        }
+        WriteCoefs(bw, table.data(), last_dc[c], dc[c > 0], ac[c > 0]);
+        last_dc[c] = table[0];
+    });
+    bw.Flush();
+    output.put(0xff);
+    output.put(0xd9);
+}
+
+void Transcode(std::istream &input, std::ostream &output, Transform transform,
+               const CropRegion &crop) {
+    CoefImage image = ReadCoefImage(input);
+    if (crop.x || crop.y || crop.width || crop.height) {
+        CropCoefs(image, crop);
+    }
+    TransformCoefs(image, transform);
+    WriteCoefImage(image, output);
+}
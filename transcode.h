@@ -0,0 +1,70 @@
+#pragma once
+
+#include "decoder.h"
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+enum class Transform {
+    kNone,
+    kFlipHorizontal,
+    kFlipVertical,
+    kTranspose,
+    kRotate90,
+    kRotate180,
+    kRotate270,
+};
+
+// Natural order index of the i-th coefficient in the zigzag order.
+extern const uint8_t kZigZag[64];
+
+// Region of the source image. x and y must be multiples of MCU size, zero
+// width or height means up to the image border.
+struct CropRegion {
+    size_t x = 0;
+    size_t y = 0;
+    size_t width = 0;
+    size_t height = 0;
+};
+
+// Quantized coefficients of one component in the natural (not zigzag) order,
+// 64 per block, blocks in the raster order.
+struct CoefPlane {
+    uint8_t id;
+    uint8_t h_thinning;
+    uint8_t v_thinning;
+    uint8_t qt_id;
+    size_t width = 0;
+    size_t height = 0;
+    std::vector<int16_t> coefs;
+};
+
+struct CoefImage {
+    uint16_t width = 0;
+    uint16_t height = 0;
+    std::string comment;
+    std::vector<QT> qts;
+    // Components in the scan order.
+    std::vector<CoefPlane> planes;
+};
+
+// Entropy decodes the baseline image without dequantization and IDCT.
+CoefImage ReadCoefImage(std::istream &input);
+
+// Keeps only MCU aligned |crop| of the image.
+void CropCoefs(CoefImage &image, const CropRegion &crop);
+
+// Applies |transform| by permuting blocks and coefficients. Partial MCUs at the
+// edges which would move to the top or the left are trimmed, like jpegtran
+// -trim does, everything else is lossless.
+void TransformCoefs(CoefImage &image, Transform transform);
+
+// Writes baseline JPEG with Huffman tables optimized for the coefficients.
+void WriteCoefImage(const CoefImage &image, std::ostream &output);
+
+// Lossless rotate/flip/crop without decoding pixels.
+void Transcode(std::istream &input, std::ostream &output, Transform transform,
+               const CropRegion &crop = {});